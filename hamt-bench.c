@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#include "hamt.h"
+#include "testing/open_table.h"
+#include "testing/split_words.h"
+
+/**
+ * Runs the same workloads against the hamt and a flat open addressing table,
+ * reading the hardware counters around each one. Counters the kernel will
+ * not give us, in a container or with a high perf_event_paranoid, show as
+ * '-'.
+ *
+ * Each map runs in a process of its own, started from the same heap, so one
+ * map doesn't inherit the heap another has left behind. The maps take turns
+ * going first over `BENCH_RUNS` runs and the median of each column is shown.
+ *
+ * Allocations are counted by linking with `--wrap` for the malloc family,
+ * see the Makefile.
+ */
+
+/*======= allocation counting =====================*/
+static unsigned long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+	allocations++;
+	return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size) {
+	allocations++;
+	return __real_aligned_alloc(alignment, size);
+}
+
+/*======= hardware counters =====================*/
+#define CACHE_EVENT(cache, op, result) \
+	((cache) | ((op) << 8) | ((result) << 16))
+
+typedef struct counter_t {
+	char *name;
+	unsigned int type;
+	unsigned long config;
+	int fd;
+} counter_t;
+
+enum { INSTRUCTIONS, CACHE_MISSES, DTLB_MISSES, BRANCH_MISSES, NUM_COUNTERS };
+
+static counter_t counters[NUM_COUNTERS] = {
+	{ "instr", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1 },
+	{ "llc-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1 },
+	{ "dtlb-miss", PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+			PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), -1 },
+	{ "br-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1 },
+};
+
+/* Each counter is opened on its own so one missing does not lose the rest */
+static void open_counters(bool report) {
+	struct perf_event_attr attr;
+
+	for (int i = 0; i < NUM_COUNTERS; ++i) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = counters[i].type;
+		attr.config = counters[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		counters[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (counters[i].fd == -1 && report) {
+			fprintf(stderr, "Counter %s unavailable: %s\n", counters[i].name,
+					strerror(errno));
+		}
+	}
+}
+
+static void close_counters() {
+	for (int i = 0; i < NUM_COUNTERS; ++i) {
+		if (counters[i].fd != -1) {
+			close(counters[i].fd);
+		}
+	}
+}
+
+static void start_counters() {
+	for (int i = 0; i < NUM_COUNTERS; ++i) {
+		if (counters[i].fd != -1) {
+			ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+static void stop_counters(uint64_t *values) {
+	for (int i = 0; i < NUM_COUNTERS; ++i) {
+		values[i] = UINT64_MAX;
+		if (counters[i].fd != -1) {
+			ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(counters[i].fd, &values[i], sizeof(uint64_t)) !=
+					sizeof(uint64_t)) {
+				values[i] = UINT64_MAX;
+			}
+		}
+	}
+}
+
+/*======= maps under test =====================*/
+typedef struct map_ops_t {
+	char *name;
+	void *(*create)(int count);
+	void (*set)(void *map, char *key, void *value);
+	void *(*get)(void *map, char *key);
+	void (*remove)(void *map, char *key);
+	void (*flush)(void *map); // NULL if writes are not held back
+	void (*free)(void *map);
+} map_ops_t;
+
+static void *create_plain(int count) {
+	(void)count;
+	return create_hamt();
+}
+
+static void *create_fingerprinted(int count) {
+	(void)count;
+	return create_hamt_flags(HAMT_FINGERPRINTS);
+}
+
+static void hamt_set_op(void *map, char *key, void *value) {
+	hamt_set((struct hamt_t *)map, key, value);
+}
+
+static void *hamt_get_op(void *map, char *key) {
+	return hamt_get((struct hamt_t *)map, key);
+}
+
+static void hamt_remove_op(void *map, char *key) {
+	hamt_remove((struct hamt_t *)map, key);
+}
+
+static void hamt_free_op(void *map) {
+	hamt_free((struct hamt_t *)map);
+}
+
+/*======= the hamt, written to in batches =====================*/
+#define BATCH_SIZE 1000
+
+typedef struct batched_t {
+	struct hamt_t *hamt;
+	hamt_batch_op_t ops[BATCH_SIZE];
+	size_t len;
+} batched_t;
+
+static void *create_batched(int count) {
+	batched_t *batched;
+
+	(void)count;
+	if ((batched = (batched_t *)malloc(sizeof(batched_t))) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for batched hamt\n");
+		exit(EXIT_FAILURE);
+	}
+	batched->hamt = create_hamt();
+	batched->len = 0;
+	return batched;
+}
+
+static void batched_flush_op(void *map) {
+	batched_t *batched = (batched_t *)map;
+
+	if (batched->len > 0) {
+		hamt_apply_batch(batched->hamt, batched->ops, batched->len);
+		batched->len = 0;
+	}
+}
+
+static void batched_push(batched_t *batched, int op,
+		char *key, void *value) {
+	batched->ops[batched->len].op = op;
+	batched->ops[batched->len].key = key;
+	batched->ops[batched->len++].value = value;
+	if (batched->len == BATCH_SIZE) {
+		batched_flush_op(batched);
+	}
+}
+
+static void batched_set_op(void *map, char *key, void *value) {
+	batched_push((batched_t *)map, HAMT_BATCH_SET, key, value);
+}
+
+static void *batched_get_op(void *map, char *key) {
+	return hamt_get(((batched_t *)map)->hamt, key);
+}
+
+static void batched_remove_op(void *map, char *key) {
+	batched_push((batched_t *)map, HAMT_BATCH_REMOVE, key, NULL);
+}
+
+static void batched_free_op(void *map) {
+	hamt_free(((batched_t *)map)->hamt);
+	free(map);
+}
+
+/* Starts small, so inserts pay for growing the same as the hamt does */
+static void *create_table(int count) {
+	(void)count;
+	return open_table_create(16);
+}
+
+static void table_set_op(void *map, char *key, void *value) {
+	open_table_set((open_table_t *)map, key, value);
+}
+
+static void *table_get_op(void *map, char *key) {
+	return open_table_get((open_table_t *)map, key);
+}
+
+static void table_remove_op(void *map, char *key) {
+	open_table_remove((open_table_t *)map, key);
+}
+
+static void table_free_op(void *map) {
+	open_table_free((open_table_t *)map);
+}
+
+static map_ops_t maps[] = {
+	{ "hamt", create_plain, hamt_set_op, hamt_get_op, hamt_remove_op, NULL,
+		hamt_free_op },
+	{ "hamt+fp", create_fingerprinted, hamt_set_op, hamt_get_op,
+		hamt_remove_op, NULL, hamt_free_op },
+	{ "hamt-batch", create_batched, batched_set_op, batched_get_op,
+		batched_remove_op, batched_flush_op, batched_free_op },
+	{ "open-table", create_table, table_set_op, table_get_op, table_remove_op,
+		NULL, table_free_op },
+};
+
+/*======= workloads =====================*/
+typedef struct keyset_t {
+	char *name;
+	char **keys;     // in insert order
+	char **shuffled; // the same keys, for lookups
+	char **misses;   // none of which are in `keys`
+	int count;
+} keyset_t;
+
+enum { INSERT, HITS, MISSES, REMOVE, NUM_WORKLOADS };
+static char *workload_names[] = { "insert", "hit", "miss", "remove" };
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static void run_workload(map_ops_t *ops, void *map, keyset_t *set, int workload) {
+	volatile unsigned long found = 0;
+
+	for (int i = 0; i < set->count; ++i) {
+		switch (workload) {
+			case INSERT: ops->set(map, set->keys[i], set->keys[i]); break;
+			case HITS:   found += ops->get(map, set->shuffled[i]) != NULL; break;
+			case MISSES: found += ops->get(map, set->misses[i]) != NULL; break;
+			case REMOVE: ops->remove(map, set->shuffled[i]); break;
+		}
+	}
+
+	if (ops->flush != NULL) {
+		ops->flush(map);
+	}
+}
+
+static void print_per_op(uint64_t value, int count) {
+	if (value == UINT64_MAX) {
+		printf(" %9s", "-");
+	} else {
+		printf(" %9.2f", (double)value / count);
+	}
+}
+
+#define BENCH_RUNS 5
+#define NUM_MAPS   (sizeof(maps) / sizeof(maps[0]))
+
+typedef struct sample_t {
+	double ns;
+	uint64_t values[NUM_COUNTERS];
+	uint64_t allocs;
+} sample_t;
+
+/* Every workload in turn on a new map */
+static void run_map(map_ops_t *ops, keyset_t *set, sample_t *samples) {
+	struct timespec start, end;
+	void *map = ops->create(set->count);
+
+	for (int w = INSERT; w <= REMOVE; ++w) {
+		unsigned long allocs = allocations;
+
+		start_counters();
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		run_workload(ops, map, set, w);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		stop_counters(samples[w].values);
+
+		samples[w].ns = elapsed_ns(&start, &end) / set->count;
+		samples[w].allocs = allocations - allocs;
+	}
+
+	ops->free(map);
+}
+
+/* `run_map` in a child, which sends its samples back over a pipe */
+static bool run_in_child(map_ops_t *ops, keyset_t *set, sample_t *samples) {
+	size_t size = sizeof(sample_t) * NUM_WORKLOADS;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) == -1) {
+		fprintf(stderr, "Failed to make a pipe: %s\n", strerror(errno));
+		return false;
+	}
+
+	if ((pid = fork()) == -1) {
+		fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+		open_counters(false);
+		run_map(ops, set, samples);
+		close_counters();
+		_exit(write(fds[1], samples, size) == (ssize_t)size ?
+				EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	close(fds[1]);
+	ssize_t got = 0, n;
+	while (got < (ssize_t)size &&
+			(n = read(fds[0], (char *)samples + got, size - got)) > 0) {
+		got += n;
+	}
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+
+	if (got != (ssize_t)size) {
+		fprintf(stderr, "Lost the results of %s on %s\n", ops->name, set->name);
+		return false;
+	}
+	return true;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static int compare_counts(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* A missing counter is UINT64_MAX, so it stays missing if most runs are */
+static void print_medians(sample_t runs[][NUM_WORKLOADS], int len, int w,
+		int count) {
+	double ns[BENCH_RUNS];
+	uint64_t values[BENCH_RUNS];
+
+	for (int r = 0; r < len; ++r) {
+		ns[r] = runs[r][w].ns;
+	}
+	qsort(ns, len, sizeof(double), compare_doubles);
+	printf(" %9.1f", ns[len / 2]);
+
+	for (int i = 0; i <= NUM_COUNTERS; ++i) {
+		for (int r = 0; r < len; ++r) {
+			values[r] = i < NUM_COUNTERS ? runs[r][w].values[i] :
+				runs[r][w].allocs;
+		}
+		qsort(values, len, sizeof(uint64_t), compare_counts);
+		print_per_op(values[len / 2], count);
+	}
+}
+
+static void bench_keyset(keyset_t *set) {
+	sample_t runs[NUM_MAPS][BENCH_RUNS][NUM_WORKLOADS];
+	int len[NUM_MAPS] = {0};
+
+	for (int r = 0; r < BENCH_RUNS; ++r) {
+		for (unsigned int i = 0; i < NUM_MAPS; ++i) {
+			unsigned int m = (i + r) % NUM_MAPS;
+
+			if (run_in_child(&maps[m], set, runs[m][len[m]])) {
+				len[m]++;
+			}
+		}
+	}
+
+	for (unsigned int m = 0; m < NUM_MAPS; ++m) {
+		for (int w = INSERT; w <= REMOVE && len[m] > 0; ++w) {
+			printf("%-10s %-7s %-11s", set->name, workload_names[w],
+					maps[m].name);
+			print_medians(runs[m], len[m], w, set->count);
+			printf("\n");
+		}
+	}
+}
+
+/*======= key sets =====================*/
+
+/* Fills in the lookup orders from `set->keys` */
+static void finish_keyset(keyset_t *set) {
+	set->shuffled = (char **)malloc(sizeof(char *) * set->count);
+	set->misses = (char **)malloc(sizeof(char *) * set->count);
+
+	memcpy(set->shuffled, set->keys, sizeof(char *) * set->count);
+	for (int i = set->count - 1; i > 0; --i) {
+		int j = rand() % (i + 1);
+		char *tmp = set->shuffled[i];
+		set->shuffled[i] = set->shuffled[j];
+		set->shuffled[j] = tmp;
+	}
+
+	for (int i = 0; i < set->count; ++i) {
+		size_t len = strlen(set->shuffled[i]);
+		set->misses[i] = (char *)malloc(len + 2);
+		memcpy(set->misses[i], set->shuffled[i], len);
+		set->misses[i][len] = '?';
+		set->misses[i][len + 1] = '\0';
+	}
+}
+
+static bool load_dictionary(keyset_t *set, char *path) {
+	int fd;
+	struct stat sb;
+	char *contents;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		fprintf(stderr, "Failed to load file: %s\n", strerror(errno));
+		return false;
+	}
+
+	if ((fstat(fd, &sb) == -1)) {
+		fprintf(stderr, "Failed to fstat file: %s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	contents = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (contents == MAP_FAILED) {
+		fprintf(stderr, "Failed to mmap file: %s\n", strerror(errno));
+		return false;
+	}
+
+	set->name = "dictionary";
+	set->keys = split_words(contents, &set->count);
+	finish_keyset(set);
+	return true;
+}
+
+/* Keys that look like ids, sharing a long prefix and differing at the end */
+static void make_ids(keyset_t *set, int count) {
+	set->name = "ids";
+	set->count = count;
+	set->keys = (char **)malloc(sizeof(char *) * count);
+
+	for (int i = 0; i < count; ++i) {
+		set->keys[i] = (char *)malloc(24);
+		snprintf(set->keys[i], 24, "user:%08x", (unsigned int)i * 2654435761U);
+	}
+
+	finish_keyset(set);
+}
+
+int main(int argc, char **argv) {
+	keyset_t sets[2];
+	int num_sets = 0;
+
+	srand(42);
+	if (load_dictionary(&sets[num_sets], argc > 1 ? argv[1] :
+				"./testing/dictionary.txt")) {
+		num_sets++;
+	}
+	make_ids(&sets[num_sets], num_sets ? sets[0].count : 200000);
+	num_sets++;
+
+	// report the counters that are missing once, each run opens its own
+	open_counters(true);
+	close_counters();
+
+	printf("%-10s %-7s %-11s %9s", "keys", "op", "map", "ns");
+	for (int i = 0; i < NUM_COUNTERS; ++i) {
+		printf(" %9s", counters[i].name);
+	}
+	printf(" %9s\n", "allocs");
+
+	for (int i = 0; i < num_sets; ++i) {
+		bench_keyset(&sets[i]);
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,572 @@
+/* hamt -- A Hash Array Mapped Trie implementation.
+ *
+ * Version 1.0 May 2021
+ *
+ * Copyright (c) 2021, James Barford-Evans
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "hamt.h"
+#include "hamt-replicated.h"
+
+#define CACHE_LINE_SIZE  64
+#define MAX_NODES        64
+
+/* Once a replica has applied this many updates it compacts when idle */
+#define COMPACT_AFTER    4096
+#define COMPACT_SLICE_US 200
+
+/* Readers are spread over this many counters, one per cache line */
+#define READER_SLOTS     16
+/* The most updates applied to a copy before readers are moved on to it */
+#define SWAP_AFTER       64
+
+/**
+ * Updates form a single log shared by every replica. Each replica keeps
+ * the last update it applied, an update is freed once every replica has
+ * moved past it.
+ */
+typedef struct update_t {
+	struct update_t *next;
+	unsigned long seq;
+	int refs;
+	bool remove;
+	char *key;
+	void *value;
+} update_t;
+
+/**
+ * Readers count themselves in here while they look in a copy. A thread
+ * always uses the same slot, so unless there are more than READER_SLOTS
+ * readers it is the only one writing to the line.
+ */
+typedef struct reader_slot_t {
+	_Alignas(CACHE_LINE_SIZE) unsigned long readers[2];
+} reader_slot_t;
+
+/**
+ * Each replica keeps two copies of the trie. Readers look in
+ * `copies[active]` while the replica's thread applies updates to the
+ * other one, then the two are swapped and the thread waits for readers to
+ * leave the old copy before bringing it up to date too. Readers never
+ * wait and never write to a line that the thread writes to.
+ *
+ * The thread is pinned to the cpus of its node and allocates the replica
+ * itself, so with first touch the replica and both copies are local to
+ * the node.
+ */
+typedef struct replica_t {
+	// only written when the copies are swapped
+	struct hamt_t *copies[2];
+	int active;
+	// which of the readers counts new readers go in
+	int version;
+	reader_slot_t slots[READER_SLOTS];
+
+	_Alignas(CACHE_LINE_SIZE) update_t *cursor;
+	unsigned long applied;
+	unsigned long since_compact;
+	// copies compacted since `since_compact` went over COMPACT_AFTER
+	int compacted;
+} replica_t;
+
+typedef struct hamt_replicated_t {
+	int len;
+	// each replica is set by its own thread, then only ever read
+	replica_t **replicas;
+	pthread_t *threads;
+	int started;
+	hamt_topology_t topology;
+	pthread_mutex_t log_lock;
+	// signalled for new updates and when a replica catches up
+	pthread_cond_t log_cond;
+	update_t *tail;
+	unsigned long seq;
+	// threads that have picked their node, and those that have set up
+	int claimed;
+	int ready;
+	bool failed;
+	bool stop;
+} hamt_replicated_t;
+
+static unsigned int next_reader_slot;
+static _Thread_local int reader_slot = -1;
+
+/*======= topology =====================*/
+/* Parse a cpulist such as "0-3,8-11" */
+static void read_cpulist(FILE *fp, hamt_topology_t *topology, int node) {
+	char buf[4096];
+	char *ptr = buf;
+
+	if (fgets(buf, sizeof(buf), fp) == NULL) {
+		return;
+	}
+
+	while (*ptr >= '0' && *ptr <= '9') {
+		long first = strtol(ptr, &ptr, 10);
+		long last = first;
+
+		if (*ptr == '-') {
+			last = strtol(ptr + 1, &ptr, 10);
+		}
+		for (long cpu = first; cpu <= last && cpu < topology->cpus; ++cpu) {
+			topology->cpu_to_node[cpu] = node;
+		}
+		if (*ptr == ',') {
+			ptr++;
+		}
+	}
+}
+
+static void read_topology(hamt_topology_t *topology) {
+	char path[128];
+	FILE *fp;
+
+	topology->cpus = sysconf(_SC_NPROCESSORS_CONF);
+	topology->nodes = 1;
+	if (topology->cpus < 1) {
+		topology->cpus = 1;
+	}
+	if ((topology->cpu_to_node = (int *)calloc(topology->cpus, sizeof(int))) == NULL) {
+		return;
+	}
+
+	for (int node = 0; node < MAX_NODES; ++node) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+				node);
+		if ((fp = fopen(path, "r")) == NULL) {
+			continue;
+		}
+		read_cpulist(fp, topology, node);
+		topology->nodes = node + 1;
+		fclose(fp);
+	}
+}
+
+static void pin_to_node(hamt_topology_t *topology, int node) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	for (int cpu = 0; cpu < topology->cpus && cpu < CPU_SETSIZE; ++cpu) {
+		if (topology->cpu_to_node[cpu] == node) {
+			CPU_SET(cpu, &set);
+		}
+	}
+
+	// a made up node might not have any cpus
+	if (CPU_COUNT(&set)) {
+		(void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+}
+
+/*======= replica threads =====================*/
+static void release_update(update_t *update) {
+	if (__atomic_sub_fetch(&update->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(update->key);
+		free(update);
+	}
+}
+
+static void apply_update(struct hamt_t *hamt, update_t *update) {
+	if (update->remove) {
+		(void)hamt_remove(hamt, update->key);
+	} else {
+		(void)hamt_set(hamt, update->key, update->value);
+	}
+}
+
+static void wait_for_readers(replica_t *replica, int version) {
+	for (int i = 0; i < READER_SLOTS; ++i) {
+		while (__atomic_load_n(&replica->slots[i].readers[version],
+					__ATOMIC_SEQ_CST) != 0) {
+			sched_yield();
+		}
+	}
+}
+
+/**
+ * Point new readers at the idle copy, then wait until nobody is reading
+ * the old one. Readers that count themselves before the version changes
+ * are waited for by the second wait, those that count themselves after it
+ * see the new copy, and the first wait makes sure nobody is left over
+ * from the swap before.
+ */
+static void swap_copies(replica_t *replica) {
+	int version = replica->version;
+
+	__atomic_store_n(&replica->active, !replica->active, __ATOMIC_SEQ_CST);
+	wait_for_readers(replica, !version);
+	__atomic_store_n(&replica->version, !version, __ATOMIC_SEQ_CST);
+	wait_for_readers(replica, version);
+}
+
+/**
+ * Apply the updates after the cursor, up to `last` or SWAP_AFTER of them,
+ * to the idle copy and hand it to readers. Then apply them to the copy
+ * readers have just left, letting go of each update as it goes past.
+ * Returns the last update applied.
+ */
+static update_t *apply_updates(replica_t *replica, update_t *last) {
+	update_t *update = replica->cursor;
+	int idle = !replica->active;
+	int applied = 0;
+
+	while (update != last && applied < SWAP_AFTER) {
+		update = update->next;
+		apply_update(replica->copies[idle], update);
+		applied++;
+	}
+	last = update;
+
+	swap_copies(replica);
+
+	update = replica->cursor;
+	while (update != last) {
+		update_t *next = update->next;
+		apply_update(replica->copies[!idle], next);
+		release_update(update);
+		update = next;
+	}
+
+	replica->cursor = last;
+	replica->since_compact += applied;
+	return last;
+}
+
+/**
+ * A slice of compaction on the idle copy, which moves it in to memory on
+ * this node. When it is done the copies are swapped so the other one is
+ * compacted next.
+ */
+static void compact_replica(replica_t *replica) {
+	if (hamt_compact_step(replica->copies[!replica->active], COMPACT_SLICE_US)) {
+		return;
+	}
+
+	swap_copies(replica);
+	if (++replica->compacted == 2) {
+		replica->compacted = 0;
+		replica->since_compact = 0;
+	}
+}
+
+static replica_t *create_replica(update_t *cursor) {
+	replica_t *replica;
+
+	if ((replica = (replica_t *)aligned_alloc(CACHE_LINE_SIZE,
+					sizeof(replica_t))) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for replica\n");
+		return NULL;
+	}
+
+	memset(replica, 0, sizeof(replica_t));
+	replica->cursor = cursor;
+	replica->copies[0] = create_hamt_owned();
+	replica->copies[1] = create_hamt_owned();
+
+	if (replica->copies[0] == NULL || replica->copies[1] == NULL) {
+		if (replica->copies[0] != NULL) {
+			hamt_free(replica->copies[0]);
+		}
+		if (replica->copies[1] != NULL) {
+			hamt_free(replica->copies[1]);
+		}
+		free(replica);
+		return NULL;
+	}
+
+	return replica;
+}
+
+static void *replica_main(void *arg) {
+	hamt_replicated_t *replicated = (hamt_replicated_t *)arg;
+	replica_t *replica;
+	int node;
+
+	pthread_mutex_lock(&replicated->log_lock);
+	node = replicated->claimed++;
+	pthread_mutex_unlock(&replicated->log_lock);
+
+	pin_to_node(&replicated->topology, node);
+	// created here so the replica and its copies are on the right node,
+	// nothing is logged until every replica is ready
+	replica = create_replica(replicated->tail);
+
+	pthread_mutex_lock(&replicated->log_lock);
+	replicated->replicas[node] = replica;
+	replicated->ready++;
+	if (replica == NULL) {
+		replicated->failed = true;
+	}
+	pthread_cond_broadcast(&replicated->log_cond);
+
+	while (replica != NULL) {
+		if (replica->cursor->next == NULL && replicated->stop) {
+			break;
+		}
+
+		if (replica->cursor->next == NULL) {
+			if (replica->since_compact >= COMPACT_AFTER) {
+				pthread_mutex_unlock(&replicated->log_lock);
+				compact_replica(replica);
+				pthread_mutex_lock(&replicated->log_lock);
+			} else {
+				pthread_cond_wait(&replicated->log_cond, &replicated->log_lock);
+			}
+			continue;
+		}
+
+		update_t *last = replicated->tail;
+		pthread_mutex_unlock(&replicated->log_lock);
+
+		last = apply_updates(replica, last);
+
+		pthread_mutex_lock(&replicated->log_lock);
+		replica->applied = last->seq;
+		pthread_cond_broadcast(&replicated->log_cond);
+	}
+
+	pthread_mutex_unlock(&replicated->log_lock);
+	return NULL;
+}
+
+/*======= public interface =====================*/
+/**
+ * Create a replica for every NUMA node in `topology`, or the machine's
+ * own topology if it is NULL.
+ */
+hamt_replicated_t *create_hamt_replicated(hamt_topology_t *topology) {
+	hamt_replicated_t *replicated;
+	update_t *sentinel;
+
+	if (topology != NULL && (topology->nodes <= 0 || topology->cpus < 0 ||
+				(topology->cpus > 0 && topology->cpu_to_node == NULL))) {
+		fprintf(stderr, "Invalid topology, it needs at least one node\n");
+		return NULL;
+	}
+
+	if ((replicated = (hamt_replicated_t *)calloc(1, sizeof(hamt_replicated_t))) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for replicated hamt\n");
+		return NULL;
+	}
+
+	if (topology == NULL) {
+		read_topology(&replicated->topology);
+	} else {
+		replicated->topology.nodes = topology->nodes;
+		replicated->topology.cpus = topology->cpus;
+		replicated->topology.cpu_to_node = (int *)calloc(
+				topology->cpus > 0 ? topology->cpus : 1, sizeof(int));
+		if (replicated->topology.cpu_to_node != NULL && topology->cpus > 0) {
+			memcpy(replicated->topology.cpu_to_node, topology->cpu_to_node,
+					sizeof(int) * topology->cpus);
+		}
+	}
+
+	replicated->len = replicated->topology.nodes;
+	replicated->replicas = (replica_t **)calloc(replicated->len,
+			sizeof(replica_t *));
+	replicated->threads = (pthread_t *)calloc(replicated->len,
+			sizeof(pthread_t));
+	sentinel = (update_t *)calloc(1, sizeof(update_t));
+
+	if (replicated->topology.cpu_to_node == NULL ||
+			replicated->replicas == NULL || replicated->threads == NULL ||
+			sentinel == NULL) {
+		fprintf(stderr, "Failed to allocate memory for replicated hamt\n");
+		free(sentinel);
+		free(replicated->threads);
+		free(replicated->replicas);
+		free(replicated->topology.cpu_to_node);
+		free(replicated);
+		return NULL;
+	}
+
+	sentinel->refs = replicated->len;
+	replicated->tail = sentinel;
+
+	pthread_mutex_init(&replicated->log_lock, NULL);
+	pthread_cond_init(&replicated->log_cond, NULL);
+
+	for (int i = 0; i < replicated->len; ++i) {
+		if (pthread_create(&replicated->threads[i], NULL, replica_main,
+					replicated) != 0) {
+			fprintf(stderr, "Failed to start replica thread\n");
+			replicated->failed = true;
+			break;
+		}
+		replicated->started++;
+	}
+
+	pthread_mutex_lock(&replicated->log_lock);
+	while (replicated->ready < replicated->started) {
+		pthread_cond_wait(&replicated->log_cond, &replicated->log_lock);
+	}
+	pthread_mutex_unlock(&replicated->log_lock);
+
+	if (replicated->failed) {
+		hamt_replicated_free(replicated);
+		return NULL;
+	}
+
+	return replicated;
+}
+
+static void append_update(hamt_replicated_t *replicated, char *key,
+		void *value, bool remove) {
+	update_t *update;
+
+	if ((update = (update_t *)malloc(sizeof(update_t))) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for update\n");
+		return;
+	}
+
+	if ((update->key = strdup(key)) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for update\n");
+		free(update);
+		return;
+	}
+
+	update->next = NULL;
+	update->refs = replicated->len;
+	update->remove = remove;
+	update->value = value;
+
+	pthread_mutex_lock(&replicated->log_lock);
+	update->seq = ++replicated->seq;
+	replicated->tail->next = update;
+	replicated->tail = update;
+	pthread_cond_broadcast(&replicated->log_cond);
+	pthread_mutex_unlock(&replicated->log_lock);
+}
+
+/**
+ * Updates are applied to each replica in the background, use
+ * `hamt_replicated_sync` to wait for them.
+ */
+void hamt_replicated_set(hamt_replicated_t *replicated, char *key, void *value) {
+	append_update(replicated, key, value, false);
+}
+
+void hamt_replicated_remove(hamt_replicated_t *replicated, char *key) {
+	append_update(replicated, key, NULL, true);
+}
+
+/* The node of the cpu the calling thread is on */
+int hamt_replicated_local_node(hamt_replicated_t *replicated) {
+	int cpu = sched_getcpu();
+
+	if (cpu < 0 || cpu >= replicated->topology.cpus) {
+		return 0;
+	}
+
+	return replicated->topology.cpu_to_node[cpu] % replicated->len;
+}
+
+/**
+ * Count ourselves as a reader of the current version, then look in
+ * whichever copy is active. Nothing is locked, the replica's thread waits
+ * for us to leave before changing the copy we are in.
+ */
+void *hamt_replicated_get_from(hamt_replicated_t *replicated, int node,
+		char *key) {
+	replica_t *replica = replicated->replicas[node % replicated->len];
+	reader_slot_t *slot;
+	void *value;
+	int version;
+
+	if (reader_slot < 0) {
+		reader_slot = __atomic_fetch_add(&next_reader_slot, 1,
+				__ATOMIC_RELAXED) % READER_SLOTS;
+	}
+	slot = &replica->slots[reader_slot];
+
+	version = __atomic_load_n(&replica->version, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&slot->readers[version], 1, __ATOMIC_SEQ_CST);
+	value = hamt_get(replica->copies[__atomic_load_n(&replica->active,
+				__ATOMIC_SEQ_CST)], key);
+	__atomic_fetch_sub(&slot->readers[version], 1, __ATOMIC_RELEASE);
+
+	return value;
+}
+
+/* Look up `key` in the replica on the caller's own node */
+void *hamt_replicated_get(hamt_replicated_t *replicated, char *key) {
+	return hamt_replicated_get_from(replicated,
+			hamt_replicated_local_node(replicated), key);
+}
+
+/* Wait for every replica to apply the updates made so far */
+void hamt_replicated_sync(hamt_replicated_t *replicated) {
+	pthread_mutex_lock(&replicated->log_lock);
+	unsigned long seq = replicated->seq;
+
+	for (int i = 0; i < replicated->len; ++i) {
+		while (replicated->replicas[i]->applied < seq) {
+			pthread_cond_wait(&replicated->log_cond, &replicated->log_lock);
+		}
+	}
+	pthread_mutex_unlock(&replicated->log_lock);
+}
+
+/* Applies any outstanding updates, then frees every replica */
+void hamt_replicated_free(hamt_replicated_t *replicated) {
+	pthread_mutex_lock(&replicated->log_lock);
+	replicated->stop = true;
+	pthread_cond_broadcast(&replicated->log_cond);
+	pthread_mutex_unlock(&replicated->log_lock);
+
+	for (int i = 0; i < replicated->started; ++i) {
+		pthread_join(replicated->threads[i], NULL);
+	}
+
+	for (int i = 0; i < replicated->len; ++i) {
+		replica_t *replica = replicated->replicas[i];
+
+		if (replica != NULL) {
+			hamt_free(replica->copies[0]);
+			hamt_free(replica->copies[1]);
+			free(replica);
+		}
+	}
+
+	// every replica has stopped on the tail
+	free(replicated->tail->key);
+	free(replicated->tail);
+	pthread_cond_destroy(&replicated->log_cond);
+	pthread_mutex_destroy(&replicated->log_lock);
+	free(replicated->topology.cpu_to_node);
+	free(replicated->threads);
+	free(replicated->replicas);
+	free(replicated);
+}
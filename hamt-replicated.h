@@ -0,0 +1,56 @@
+/* hamt -- A Hash Array Mapped Trie implementation.
+ *
+ * Version 1.0 May 2021
+ *
+ * Copyright (c) 2021, James Barford-Evans
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef HAMT_REPLICATED_H
+#define HAMT_REPLICATED_H
+
+/**
+ * Which NUMA node each cpu belongs to. Passing NULL to
+ * `create_hamt_replicated` reads it from /sys, or a made up one can be
+ * passed in to try it out on a machine with a single node.
+ */
+typedef struct hamt_topology_t {
+	int nodes;
+	int cpus;
+	int *cpu_to_node;
+} hamt_topology_t;
+
+struct hamt_replicated_t;
+
+struct hamt_replicated_t *create_hamt_replicated(hamt_topology_t *topology);
+void hamt_replicated_set(struct hamt_replicated_t *replicated, char *key,
+		void *value);
+void hamt_replicated_remove(struct hamt_replicated_t *replicated, char *key);
+void *hamt_replicated_get(struct hamt_replicated_t *replicated, char *key);
+void *hamt_replicated_get_from(struct hamt_replicated_t *replicated, int node,
+		char *key);
+int hamt_replicated_local_node(struct hamt_replicated_t *replicated);
+void hamt_replicated_sync(struct hamt_replicated_t *replicated);
+void hamt_replicated_free(struct hamt_replicated_t *replicated);
+
+#endif
@@ -0,0 +1,227 @@
+/* hamt -- A Hash Array Mapped Trie implementation.
+ *
+ * Version 1.0 May 2021
+ *
+ * Copyright (c) 2021, James Barford-Evans
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hamt.h"
+#include "hamt-sharded.h"
+
+#define CACHE_LINE_SIZE  64
+#define MAX_SHARD_BITS   16
+#define SHARD_MULTIPLIER 0x9E3779B1U
+
+/**
+ * A trie of its own behind its own lock, padded out to a cache line so
+ * writers on different shards never share one. Each hamt allocates and
+ * accounts for its own nodes, key arena and compacted region.
+ */
+typedef struct shard_t {
+	_Alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+	struct hamt_t *hamt;
+} shard_t;
+
+typedef struct hamt_sharded_t {
+	int bits;
+	int len;
+	int flags;
+	shard_t *shards;
+} hamt_sharded_t;
+
+/**
+ * Keys go to a shard by the top bits of their hash. The trie in the shard
+ * starts from the bottom bits, so its root is as full as it would be on
+ * its own. Short keys hardly reach the top bits, multiplying by 2^32 over
+ * the golden ratio first spreads the rest of the hash up in to them.
+ */
+static shard_t *shard_for(hamt_sharded_t *sharded, char *key) {
+	unsigned int hash = hamt_hash(key) * SHARD_MULTIPLIER;
+
+	if (sharded->bits == 0) {
+		return &sharded->shards[0];
+	}
+
+	return &sharded->shards[hash >> (32 - sharded->bits)];
+}
+
+/**
+ * Split the keys over `nshards` tries, rounded up to a power of 2, each made
+ * with `flags`. Threads writing to different shards do not wait on each
+ * other.
+ */
+hamt_sharded_t *create_hamt_sharded(int nshards, int flags) {
+	hamt_sharded_t *sharded;
+	int bits = 0;
+
+	while ((1 << bits) < nshards && bits < MAX_SHARD_BITS) {
+		bits++;
+	}
+
+	if ((sharded = (hamt_sharded_t *)malloc(sizeof(hamt_sharded_t))) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for sharded hamt\n");
+		return NULL;
+	}
+
+	sharded->bits = bits;
+	sharded->len = 1 << bits;
+	sharded->flags = flags;
+	sharded->shards = (shard_t *)aligned_alloc(CACHE_LINE_SIZE,
+			sizeof(shard_t) * sharded->len);
+	if (sharded->shards == NULL) {
+		fprintf(stderr, "Failed to allocate memory for shards\n");
+		free(sharded);
+		return NULL;
+	}
+
+	for (int i = 0; i < sharded->len; ++i) {
+		shard_t *shard = &sharded->shards[i];
+
+		memset(shard, 0, sizeof(shard_t));
+		if ((shard->hamt = create_hamt_flags(flags)) == NULL) {
+			// only the shards before this one have anything to free
+			sharded->len = i;
+			hamt_sharded_free(sharded);
+			return NULL;
+		}
+		pthread_rwlock_init(&shard->lock, NULL);
+	}
+
+	return sharded;
+}
+
+void hamt_sharded_set(hamt_sharded_t *sharded, char *key, void *value) {
+	shard_t *shard = shard_for(sharded, key);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	shard->hamt = hamt_set(shard->hamt, key, value);
+	pthread_rwlock_unlock(&shard->lock);
+}
+
+void hamt_sharded_remove(hamt_sharded_t *sharded, char *key) {
+	shard_t *shard = shard_for(sharded, key);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	shard->hamt = hamt_remove(shard->hamt, key);
+	pthread_rwlock_unlock(&shard->lock);
+}
+
+void *hamt_sharded_get(hamt_sharded_t *sharded, char *key) {
+	shard_t *shard = shard_for(sharded, key);
+	void *value;
+
+	pthread_rwlock_rdlock(&shard->lock);
+	value = hamt_get(shard->hamt, key);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return value;
+}
+
+/**
+ * Call `fn` with every entry, a shard at a time. Only the shard being
+ * visited is locked, the others can be written to meanwhile.
+ */
+void hamt_sharded_for_each(hamt_sharded_t *sharded,
+		void (*fn)(char *key, void *value, void *ctx), void *ctx) {
+	for (int i = 0; i < sharded->len; ++i) {
+		shard_t *shard = &sharded->shards[i];
+
+		// no fragments of prefix match every entry
+		pthread_rwlock_rdlock(&shard->lock);
+		hamt_visit_prefix(shard->hamt, 0, 0, fn, ctx);
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+void hamt_sharded_stats(hamt_sharded_t *sharded, hamt_sharded_stats_t *stats) {
+	memset(stats, 0, sizeof(hamt_sharded_stats_t));
+	stats->shards = sharded->len;
+
+	for (int i = 0; i < sharded->len; ++i) {
+		shard_t *shard = &sharded->shards[i];
+
+		pthread_rwlock_rdlock(&shard->lock);
+		size_t count = hamt_count(shard->hamt);
+		stats->bytes += hamt_bytes(shard->hamt);
+		pthread_rwlock_unlock(&shard->lock);
+
+		stats->count += count;
+		if (i == 0 || count < stats->min_count) {
+			stats->min_count = count;
+		}
+		if (count > stats->max_count) {
+			stats->max_count = count;
+		}
+	}
+}
+
+static void copy_entry(char *key, void *value, void *ctx) {
+	struct hamt_t **copy = (struct hamt_t **)ctx;
+	*copy = hamt_set(*copy, key, value);
+}
+
+/**
+ * A single hamt with every entry, made with the shards' flags and its own
+ * copy of the keys. Shards are copied one at a time with only that one
+ * locked, so writers to the rest carry on. Every entry in a shard is as it
+ * was at one moment, but each shard is from a different moment. Two keys
+ * changed together may show one change and not the other if they are in
+ * different shards.
+ */
+struct hamt_t *hamt_sharded_snapshot(hamt_sharded_t *sharded) {
+	struct hamt_t *copy = create_hamt_flags(sharded->flags | HAMT_OWN_KEYS);
+
+	if (copy == NULL) {
+		return NULL;
+	}
+
+	for (int i = 0; i < sharded->len; ++i) {
+		shard_t *shard = &sharded->shards[i];
+
+		pthread_rwlock_rdlock(&shard->lock);
+		hamt_visit_prefix(shard->hamt, 0, 0, copy_entry, &copy);
+		pthread_rwlock_unlock(&shard->lock);
+	}
+
+	return copy;
+}
+
+/* Nothing else can be using it */
+void hamt_sharded_free(hamt_sharded_t *sharded) {
+	for (int i = 0; i < sharded->len; ++i) {
+		shard_t *shard = &sharded->shards[i];
+
+		pthread_rwlock_destroy(&shard->lock);
+		hamt_free(shard->hamt);
+	}
+
+	free(sharded->shards);
+	free(sharded);
+}
@@ -0,0 +1,56 @@
+/* hamt -- A Hash Array Mapped Trie implementation.
+ *
+ * Version 1.0 May 2021
+ *
+ * Copyright (c) 2021, James Barford-Evans
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef HAMT_SHARDED_H
+#define HAMT_SHARDED_H
+
+#include <stddef.h>
+
+struct hamt_t;
+struct hamt_sharded_t;
+
+typedef struct hamt_sharded_stats_t {
+	int shards;
+	size_t count;
+	size_t bytes;
+	size_t min_count; // entries in the emptiest shard
+	size_t max_count; // and in the fullest
+} hamt_sharded_stats_t;
+
+struct hamt_sharded_t *create_hamt_sharded(int nshards, int flags);
+void hamt_sharded_set(struct hamt_sharded_t *sharded, char *key, void *value);
+void hamt_sharded_remove(struct hamt_sharded_t *sharded, char *key);
+void *hamt_sharded_get(struct hamt_sharded_t *sharded, char *key);
+void hamt_sharded_for_each(struct hamt_sharded_t *sharded,
+		void (*fn)(char *key, void *value, void *ctx), void *ctx);
+void hamt_sharded_stats(struct hamt_sharded_t *sharded,
+		hamt_sharded_stats_t *stats);
+struct hamt_t *hamt_sharded_snapshot(struct hamt_sharded_t *sharded);
+void hamt_sharded_free(struct hamt_sharded_t *sharded);
+
+#endif
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -6,8 +7,14 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <stdint.h>
 
 #include "hamt.h"
+#include "hamt-replicated.h"
+#include "hamt-sharded.h"
+#include "testing/split_words.h"
 
 void test_case_1() {
 	struct hamt_t *hamt = create_hamt();
@@ -31,16 +38,48 @@ void test_case_1() {
 	printf("collision value2: %s\n", collision_2);
 }
 
+void test_case_owned_keys() {
+	struct hamt_t *hamt = create_hamt_owned();
+	char short_key[32];
+	char long_key[64];
+
+	strcpy(short_key, "short");
+	strcpy(long_key, "a/rather/long/api/route/that/goes/in/the/arena");
+	hamt = hamt_set(hamt, short_key, "inline");
+	hamt = hamt_set(hamt, long_key, "arena");
+
+	// the hamt has its own copies
+	memset(short_key, 'x', sizeof(short_key) - 1);
+	memset(long_key, 'x', sizeof(long_key) - 1);
+
+	char *value1 = (char *)hamt_get(hamt, "short");
+	char *value2 = (char *)hamt_get(hamt,
+			"a/rather/long/api/route/that/goes/in/the/arena");
+	printf("owned inline: %s\n", value1);
+	printf("owned arena: %s\n", value2);
+
+	hamt = hamt_set(hamt, "a/rather/long/api/route/that/goes/in/the/arena",
+			"arena again");
+	hamt = hamt_remove(hamt, "short");
+	value1 = (char *)hamt_get(hamt, "short");
+	value2 = (char *)hamt_get(hamt,
+			"a/rather/long/api/route/that/goes/in/the/arena");
+	printf("owned removed: %s\n", value1);
+	printf("owned replaced: %s\n", value2);
+}
+
+/**
+ * The hamt owns its keys so the words are used in place as values, rather
+ * than each one being `strdup`'d
+ */
 void insert_dictionary(struct hamt_t **hamt, char *dictionary) {
 	char *ptr = dictionary;
 
 	while (*dictionary != '\0') {
 		if (*dictionary == '\n') {
 			*dictionary = '\0';
-			char *str = strdup(ptr);
-			*hamt = hamt_set(*hamt, str, str);
+			*hamt = hamt_set(*hamt, ptr, ptr);
 			ptr = dictionary + 1;
-			*dictionary = '\n';
 		}
 		dictionary++;
 	}
@@ -105,7 +144,7 @@ failed:
 
 
 void test_case_2(char *contents) {
-	struct hamt_t *hamt = create_hamt();
+	struct hamt_t *hamt = create_hamt_owned();
 
 	insert_dictionary(&hamt, strdup(contents));
 	dictionary_check(hamt, strdup(contents));
@@ -115,6 +154,967 @@ void test_case_2(char *contents) {
 	dictionary_check(hamt, strdup(contents));
 }
 
+double time_lookups(struct hamt_t *hamt, char **keys, int count) {
+	struct timespec start, end;
+	int found = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < count; ++i) {
+		if (hamt_get(hamt, keys[i]) != NULL) {
+			found++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	(void)found;
+	return ((end.tv_sec - start.tv_sec) * 1e9 +
+			(end.tv_nsec - start.tv_nsec)) / count;
+}
+
+int count_present(struct hamt_t *hamt, char **words, int count) {
+	int present = 0;
+
+	for (int i = 0; i < count; ++i) {
+		if (hamt_get(hamt, words[i]) == words[i]) {
+			present++;
+		}
+	}
+
+	return present;
+}
+
+/* Lookups that come back with anything at all */
+int count_found(struct hamt_t *hamt, char **keys, int count) {
+	int found = 0;
+
+	for (int i = 0; i < count; ++i) {
+		if (hamt_get(hamt, keys[i]) != NULL) {
+			found++;
+		}
+	}
+
+	return found;
+}
+
+/* The quickest of a few runs, one run is too noisy to compare */
+double best_lookups(struct hamt_t *hamt, char **keys, int count) {
+	double best = time_lookups(hamt, keys, count);
+
+	for (int i = 0; i < 2; ++i) {
+		double ns = time_lookups(hamt, keys, count);
+		if (ns < best) {
+			best = ns;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * Lookups of words with a '?' on the end, none of which are in the
+ * dictionary, against a hamt with and without fingerprints. Both have to
+ * find every word and none of the misses.
+ */
+void bench_misses(char *contents) {
+	int count;
+	char **words = split_words(contents, &count);
+	char **misses = (char **)malloc(sizeof(char *) * count);
+	char **mixed = (char **)malloc(sizeof(char *) * count);
+	struct hamt_t *plain = create_hamt_flags(HAMT_OWN_KEYS);
+	struct hamt_t *fingerprinted = create_hamt_flags(HAMT_OWN_KEYS |
+			HAMT_FINGERPRINTS);
+
+	for (int i = 0; i < count; ++i) {
+		size_t len = strlen(words[i]);
+		misses[i] = (char *)malloc(len + 2);
+		memcpy(misses[i], words[i], len);
+		misses[i][len] = '?';
+		misses[i][len + 1] = '\0';
+		// roughly 30% misses
+		mixed[i] = (i % 10) < 3 ? misses[i] : words[i];
+
+		plain = hamt_set(plain, words[i], words[i]);
+		fingerprinted = hamt_set(fingerprinted, words[i], words[i]);
+	}
+
+	struct hamt_t *tries[] = { plain, fingerprinted };
+	for (int i = 0; i < 2; ++i) {
+		int present = count_present(tries[i], words, count);
+		int found = count_found(tries[i], misses, count);
+
+		printf("%s hits: %d/%d misses found: %d\n", i ? "fingerprints" : "plain",
+				present, count, found);
+		if (present != count || found != 0) {
+			fprintf(stderr, "Lookups with%s fingerprints went wrong\n",
+					i ? "" : "out");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	printf("Lookup ns/op      hits   misses  30%% misses\n");
+	printf("plain         %8.1f %8.1f %8.1f\n", best_lookups(plain, words, count),
+			best_lookups(plain, misses, count), best_lookups(plain, mixed, count));
+	printf("fingerprints  %8.1f %8.1f %8.1f\n",
+			best_lookups(fingerprinted, words, count),
+			best_lookups(fingerprinted, misses, count),
+			best_lookups(fingerprinted, mixed, count));
+}
+/**
+ * 90% of lookups go to 256 hot words, the rest are spread over the whole
+ * dictionary.
+ */
+void bench_front_cache(char *contents) {
+	int count;
+	char **words = split_words(contents, &count);
+	char **skewed = (char **)malloc(sizeof(char *) * count);
+	struct hamt_t *plain = create_hamt_owned();
+	struct hamt_t *cached = create_hamt_owned();
+	hamt_cache_stats_t stats;
+
+	hamt_enable_front_cache(cached, 1024);
+
+	srand(1);
+	for (int i = 0; i < count; ++i) {
+		skewed[i] = (rand() % 10) ? words[rand() % 256] : words[rand() % count];
+		plain = hamt_set(plain, words[i], words[i]);
+		cached = hamt_set(cached, words[i], words[i]);
+	}
+
+	double plain_ns = time_lookups(plain, skewed, count);
+	double cached_ns = time_lookups(cached, skewed, count);
+	hamt_front_cache_stats(cached, &stats);
+
+	printf("Skewed lookups ns/op plain: %.1f front cache: %.1f\n", plain_ns,
+			cached_ns);
+	printf("Front cache hits: %lu misses: %lu hit rate: %.2f\n", stats.hits,
+			stats.misses, stats.hit_rate);
+
+	// both are hot so will be in the cache
+	cached = hamt_set(cached, words[0], "changed");
+	cached = hamt_remove(cached, words[1]);
+	printf("Front cache after set: %s\n", (char *)hamt_get(cached, words[0]));
+	printf("Front cache after remove: %s\n", (char *)hamt_get(cached, words[1]));
+
+	// an upsert which keeps the value leaves words[2] cached
+	hamt_get(cached, words[2]);
+	hamt_get_or_insert(cached, words[2], "other");
+	hamt_front_cache_stats(cached, &stats);
+	unsigned long hits = stats.hits;
+	hamt_get(cached, words[2]);
+	hamt_front_cache_stats(cached, &stats);
+	printf("Front cache kept after upsert: %s\n",
+			stats.hits == hits + 1 ? "yes" : "no");
+}
+/**
+ * Churn the hamt so its nodes are spread about the heap, then compact it
+ * both in one go and a bit at a time with changes in between.
+ */
+void test_case_compact(char *contents) {
+	int count;
+	char **words = split_words(contents, &count);
+	struct hamt_t *hamt = create_hamt_owned();
+
+	for (int round = 0; round < 3; ++round) {
+		for (int i = round; i < count; i += 2) {
+			hamt = hamt_set(hamt, words[i], words[i]);
+		}
+		for (int i = round; i < count; i += 3) {
+			hamt = hamt_remove(hamt, words[i]);
+		}
+	}
+	for (int i = 0; i < count; ++i) {
+		hamt = hamt_set(hamt, words[i], words[i]);
+	}
+
+	double before = time_lookups(hamt, words, count);
+	hamt_compact(hamt);
+	double after = time_lookups(hamt, words, count);
+
+	printf("Compacted lookups ns/op before: %.1f after: %.1f\n", before, after);
+	printf("Compacted present: %d/%d\n", count_present(hamt, words, count), count);
+
+	int steps = 0;
+	int i = 0;
+	while (hamt_compact_step(hamt, 50)) {
+		// keep changing it in between
+		hamt = hamt_remove(hamt, words[i]);
+		hamt = hamt_set(hamt, words[i], words[i]);
+		i = (i + 7919) % count;
+		steps++;
+	}
+	printf("Incremental compaction steps: %d present: %d/%d\n", steps + 1,
+			count_present(hamt, words, count), count);
+
+	// emptied part way through a compaction, nothing should be left over
+	struct hamt_t *emptied = create_hamt();
+	for (int i = 0; i < count; ++i) {
+		emptied = hamt_set(emptied, words[i], words[i]);
+	}
+	hamt_compact_step(emptied, 1);
+	for (int i = 0; i < count; ++i) {
+		emptied = hamt_remove(emptied, words[i]);
+	}
+	printf("Compaction emptied part way bytes: %zu\n", hamt_bytes(emptied));
+	hamt_free(emptied);
+}
+
+static void *increment(void *value, int found, void *ctx) {
+	(void)ctx;
+	return (void *)((intptr_t)(found ? value : 0) + 1);
+}
+
+static void *unchanged(void *value, int found, void *ctx) {
+	return found ? value : ctx;
+}
+
+/**
+ * Count how many times each word turns up with one walk of the trie per
+ * word, then take the counts back out.
+ */
+void test_case_upsert(char *contents) {
+	int count;
+	char **words = split_words(contents, &count);
+	struct hamt_t *hamt = create_hamt_owned();
+	int correct = 0;
+
+	for (int round = 0; round < 3; ++round) {
+		for (int i = 0; i < count; ++i) {
+			hamt_upsert(hamt, words[i], increment, NULL);
+		}
+	}
+
+	size_t bytes = hamt_bytes(hamt);
+	for (int i = 0; i < count; ++i) {
+		hamt_upsert(hamt, words[i], unchanged, NULL);
+	}
+	printf("Upsert unchanged allocated: %zu bytes\n", hamt_bytes(hamt) - bytes);
+
+	printf("Get or insert existing: %ld new: %s\n",
+			(long)(intptr_t)hamt_get_or_insert(hamt, words[0], "new"),
+			(char *)hamt_get_or_insert(hamt, "not-a-word", "new"));
+
+	for (int i = 0; i < count; ++i) {
+		void *value;
+		hamt = hamt_remove_take(hamt, words[i], &value);
+		// duplicates in the dictionary were counted together
+		if (value != NULL && (intptr_t)value % 3 == 0) {
+			correct++;
+		}
+	}
+
+	hamt = hamt_remove(hamt, "not-a-word");
+	printf("Upsert counts taken: %d entries left: %zu\n", correct,
+			hamt_count(hamt));
+	hamt_free(hamt);
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/* `hamt_set` every word one at a time, giving back ns per word */
+static double time_single_sets(struct hamt_t **hamt, char **words, int count) {
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < count; ++i) {
+		*hamt = hamt_set(*hamt, words[i], words[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return elapsed_ns(&start, &end) / count;
+}
+
+/* The same sets as `time_single_sets` in batches of 1000 */
+static double time_batched_sets(struct hamt_t **hamt, hamt_batch_op_t *ops,
+		char **words, int count) {
+	struct timespec start, end;
+	int n = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < count; ++i) {
+		ops[n].op = HAMT_BATCH_SET;
+		ops[n].key = words[i];
+		ops[n++].value = words[i];
+		if (n == 1000 || i == count - 1) {
+			*hamt = hamt_apply_batch(*hamt, ops, n);
+			n = 0;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return elapsed_ns(&start, &end) / count;
+}
+
+#define BATCH_ROUNDS 3
+
+/**
+ * Load the dictionary in batches of 1000 and with one `hamt_set` per word,
+ * then take every other word back out in batches mixed with sets.
+ *
+ * The loads are timed over a few rounds taking turns at going first, as
+ * whichever goes second gets a heap the first one has already grown. This
+ * build is unoptimised and shares its heap with the other tests, the
+ * `hamt-batch` rows of `make bench` are the fairer comparison.
+ */
+void test_case_batch(char *contents) {
+	int count;
+	char **words = split_words(contents, &count);
+	struct hamt_t *batched = NULL;
+	struct hamt_t *single = NULL;
+	hamt_batch_op_t *ops = (hamt_batch_op_t *)malloc(sizeof(hamt_batch_op_t) * 1000);
+	double single_ns = 0, batched_ns = 0;
+	int n = 0;
+
+	for (int round = 0; round < BATCH_ROUNDS; ++round) {
+		double single_round, batched_round;
+
+		if (round > 0) {
+			hamt_free(single);
+			hamt_free(batched);
+		}
+		single = create_hamt();
+		batched = create_hamt();
+		if (round % 2) {
+			batched_round = time_batched_sets(&batched, ops, words, count);
+			single_round = time_single_sets(&single, words, count);
+		} else {
+			single_round = time_single_sets(&single, words, count);
+			batched_round = time_batched_sets(&batched, ops, words, count);
+		}
+		if (round == 0 || single_round < single_ns) {
+			single_ns = single_round;
+		}
+		if (round == 0 || batched_round < batched_ns) {
+			batched_ns = batched_round;
+		}
+	}
+
+	printf("Batch set ns/op single: %.1f batched: %.1f\n", single_ns,
+			batched_ns);
+	printf("Batch present: %d/%d\n", count_present(batched, words, count), count);
+
+	// every key is in already, so only the values change
+	single_ns = time_single_sets(&single, words, count);
+	batched_ns = time_batched_sets(&batched, ops, words, count);
+	printf("Batch overwrite ns/op single: %.1f batched: %.1f\n", single_ns,
+			batched_ns);
+
+	for (int i = 0; i < count; ++i) {
+		// a remove then a set of the same key has to leave it in
+		ops[n].op = (i % 2 || i % 3 == 0) ? HAMT_BATCH_REMOVE : HAMT_BATCH_SET;
+		ops[n].key = words[i];
+		ops[n++].value = words[i];
+		if (i % 3 == 0) {
+			ops[n].op = HAMT_BATCH_SET;
+			ops[n].key = words[i];
+			ops[n++].value = words[i];
+		}
+		if (n >= 998 || i == count - 1) {
+			batched = hamt_apply_batch(batched, ops, n);
+			n = 0;
+		}
+	}
+
+	int expected = 0;
+	for (int i = 0; i < count; ++i) {
+		if (i % 2 == 0 || i % 3 == 0) {
+			expected += hamt_get(batched, words[i]) == words[i];
+		} else {
+			expected += hamt_get(batched, words[i]) == NULL;
+		}
+	}
+	printf("Batch removed every other: %d/%d as expected, count: %zu\n",
+			expected, count, hamt_count(batched));
+
+	free(ops);
+	hamt_free(single);
+	hamt_free(batched);
+}
+
+static int destroyed = 0;
+
+static void count_destroyed(void *value) {
+	destroyed++;
+	free(value);
+}
+
+/**
+ * Push the whole dictionary through a cache with room for a fraction of it,
+ * looking up a hot set as we go which should stay in once it is back in.
+ */
+void test_case_cache(char *contents) {
+	int count;
+	char **words = split_words(contents, &count);
+	size_t max_bytes = 1024 * 1024;
+	struct hamt_t *hamt = create_hamt_cache(0, max_bytes, count_destroyed);
+	int hot = 500;
+	int inserted = count + 1;
+	size_t peak = 0;
+
+	for (int i = 0; i < count; ++i) {
+		hamt = hamt_set_ttl(hamt, words[i], strdup(words[i]),
+				strlen(words[i]) + 1, 0);
+		if (hamt_bytes(hamt) > peak) {
+			peak = hamt_bytes(hamt);
+		}
+		if (i % 16 == 0) {
+			for (int j = 0; j < hot; j += 10) {
+				char *word = words[(i / 16 + j) % hot];
+				// put back whatever has been evicted, as a cache would
+				if (hamt_get(hamt, word) == NULL) {
+					hamt = hamt_set_ttl(hamt, word, strdup(word), strlen(word) + 1, 0);
+					inserted++;
+				}
+			}
+		}
+	}
+
+	printf("Cache entries: %zu bytes: %zu peak: %zu limit: %zu\n",
+			hamt_count(hamt), hamt_bytes(hamt), peak, max_bytes);
+	int present = 0;
+	for (int i = 0; i < hot; ++i) {
+		char *value = hamt_get(hamt, words[i]);
+		if (value != NULL && strcmp(value, words[i]) == 0) {
+			present++;
+		}
+	}
+	printf("Cache hot present: %d/%d evicted: %d\n", present, hot, destroyed);
+
+	struct timespec wait = { .tv_sec = 0, .tv_nsec = 2000000 };
+	hamt = hamt_set_ttl(hamt, "expiring", strdup("soon"), 5, 1);
+	nanosleep(&wait, NULL);
+	printf("Cache expired: %s\n", (char *)hamt_get(hamt, "expiring"));
+
+	hamt_free(hamt);
+	printf("Cache values destroyed: %d/%d\n", destroyed, inserted);
+
+	// too small for anything, the entry just written is still kept
+	struct hamt_t *tiny = create_hamt_cache(0, 256, free);
+	printf("Cache over limit get or insert: %s\n",
+			(char *)hamt_get_or_insert(tiny, "some-key", strdup("value")));
+	printf("Cache over limit next: %s\n",
+			(char *)hamt_get_or_insert(tiny, "other-key", strdup("other")));
+	printf("Cache over limit first evicted: %s\n",
+			hamt_get(tiny, "some-key") == NULL ? "yes" : "no");
+	// still over the limit, finding the key must not destroy what it returns
+	void *found = hamt_get_or_insert(tiny, "other-key", "again");
+	printf("Cache over limit get or insert existing: %s\n",
+			hamt_get(tiny, "other-key") == found ? "kept" : "evicted");
+	hamt_free(tiny);
+
+	// the block a compaction step sets aside for the copy is not all used yet
+	struct hamt_t *full = create_hamt_cache(0, 256 * 1024, free);
+	for (int i = 0; i < count && i < 20000; ++i) {
+		full = hamt_set_ttl(full, words[i], strdup(words[i]),
+				strlen(words[i]) + 1, 0);
+	}
+	size_t before = hamt_count(full);
+	hamt_compact_step(full, 1);
+	full = hamt_set_ttl(full, "after-step", strdup("value"), 6, 0);
+	printf("Cache kept after a compaction step: %s\n",
+			hamt_count(full) >= before * 9 / 10 ? "yes" : "no");
+	hamt_free(full);
+
+	// keys too long to go in the leaf, with a limit smaller than a key chunk
+	struct hamt_t *small = create_hamt_cache(0, 32 * 1024, free);
+	char long_key[64];
+	for (int i = 0; i < 5000; ++i) {
+		snprintf(long_key, sizeof(long_key), "a-key-too-long-for-the-leaf-%d", i);
+		small = hamt_set_ttl(small, long_key, strdup(long_key), 8, 0);
+	}
+	printf("Cache small limit long keys more than one: %s\n",
+			hamt_count(small) > 1 ? "yes" : "no");
+	hamt_free(small);
+}
+
+/**
+ * The same dictionary with different node sizes, then with auto tuning and
+ * most of the lookups going to one word.
+ */
+void test_case_options(char *contents) {
+	int count;
+	char **words = split_words(contents, &count);
+	int sizes[][2] = { { 4, 2 }, { 16, 8 }, { 32, 16 } };
+	hamt_options_t options = { .max_branch_size = 8, .min_array_node_size = 8 };
+
+	printf("Invalid node sizes: %s\n",
+			create_hamt_with_options(&options) == NULL ? "rejected" : "accepted");
+
+	printf("max_branch bytes      ns/op  present\n");
+	for (int i = 0; i < 3; ++i) {
+		options.max_branch_size = sizes[i][0];
+		options.min_array_node_size = sizes[i][1];
+		struct hamt_t *hamt = create_hamt_with_options(&options);
+
+		for (int j = 0; j < count; ++j) {
+			hamt = hamt_set(hamt, words[j], words[j]);
+		}
+		printf("%10d %9zu %6.1f %d/%d\n", sizes[i][0], hamt_bytes(hamt),
+				time_lookups(hamt, words, count),
+				count_present(hamt, words, count), count);
+		hamt_free(hamt);
+	}
+
+	struct hamt_t *tuned = create_hamt_with_options(
+			&(hamt_options_t){ .auto_tune = 1 });
+	for (int i = 0; i < count; ++i) {
+		tuned = hamt_set(tuned, words[i], words[i]);
+	}
+	hamt_get_options(tuned, &options);
+	size_t bytes = hamt_bytes(tuned);
+	printf("Auto tuned after inserts max_branch: %d min_array: %d bytes: %zu\n",
+			options.max_branch_size, options.min_array_node_size, bytes);
+
+	for (int i = 0; i < count * 4; ++i) {
+		hamt_get(tuned, words[i % 16 ? 0 : i % count]);
+	}
+	hamt_tune(tuned);
+	hamt_get_options(tuned, &options);
+	printf("Auto tuned after lookups max_branch: %d min_array: %d "
+			"hot subtree grew: %s\n", options.max_branch_size,
+			options.min_array_node_size, hamt_bytes(tuned) > bytes ? "yes" : "no");
+	printf("Auto tuned present: %d/%d\n", count_present(tuned, words, count),
+			count);
+
+	for (int i = 0; i < count; ++i) {
+		tuned = hamt_remove(tuned, words[i]);
+	}
+	printf("Auto tuned after removing all: %zu bytes\n", hamt_bytes(tuned));
+	hamt_free(tuned);
+}
+
+static void *add_key_length(char *key, void *value, void *acc) {
+	(void)value;
+	return (void *)((intptr_t)acc + strlen(key));
+}
+
+static void *add_lengths(void *left, void *right) {
+	return (void *)((intptr_t)left + (intptr_t)right);
+}
+
+static intptr_t visited_length = 0;
+
+static void visit_length(char *key, void *value) {
+	(void)value;
+	visited_length += strlen(key);
+}
+
+static void count_entry(char *key, void *value, void *ctx) {
+	(void)key;
+	(void)value;
+	__atomic_add_fetch((int *)ctx, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sum the length of every key one thread at a time with `visit_all`, then
+ * with the parallel fold on more and more threads.
+ */
+void test_case_parallel(char *contents) {
+	int count;
+	char **words = split_words(contents, &count);
+	struct hamt_t *hamt = create_hamt();
+	struct timespec start, end;
+
+	for (int i = 0; i < count; ++i) {
+		hamt = hamt_set(hamt, words[i], words[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	visit_all(hamt, visit_length);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Parallel fold visit_all: %ld in %.2fms\n", (long)visited_length,
+			elapsed_ns(&start, &end) / 1e6);
+
+	for (int nthreads = 1; nthreads <= 8; nthreads *= 2) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		intptr_t length = (intptr_t)hamt_parallel_fold(hamt, add_key_length,
+				add_lengths, nthreads);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		printf("Parallel fold %d threads: %ld in %.2fms\n", nthreads,
+				(long)length, elapsed_ns(&start, &end) / 1e6);
+	}
+
+	int entries = 0;
+	hamt_parallel_for_each(hamt, count_entry, &entries, 0);
+	printf("Parallel for each entries: %d of %zu\n", entries, hamt_count(hamt));
+	hamt_free(hamt);
+
+	// lots of small folds, where starting threads each time would dominate
+	struct hamt_t *small = create_hamt();
+	intptr_t expected = 0;
+	int right = 0;
+
+	for (int i = 0; i < 256; ++i) {
+		small = hamt_set(small, words[i], words[i]);
+		expected += strlen(words[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < 1000; ++i) {
+		right += (intptr_t)hamt_parallel_fold(small, add_key_length, add_lengths,
+				4) == expected;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Parallel fold 1000 small folds: %d right in %.2fms\n", right,
+			elapsed_ns(&start, &end) / 1e6);
+	hamt_free(small);
+}
+
+static uint64_t string_digest(void *value) {
+	uint64_t digest = 14695981039346656037ULL;
+
+	for (char *ptr = (char *)value; *ptr != '\0'; ++ptr) {
+		digest = (digest ^ (unsigned char)*ptr) * 1099511628211ULL;
+	}
+	return digest;
+}
+
+typedef struct divergent_keys_t {
+	struct hamt_t *hamt;
+	char *changed;
+	char *removed;
+	int found;
+} divergent_keys_t;
+
+static void check_divergent_key(char *key, void *value, void *ctx) {
+	divergent_keys_t *keys = (divergent_keys_t *)ctx;
+
+	(void)value;
+	if (strcmp(key, keys->changed) == 0 || strcmp(key, keys->removed) == 0) {
+		keys->found++;
+	}
+}
+
+static void diverged(unsigned int prefix, int depth, void *ctx) {
+	divergent_keys_t *keys = (divergent_keys_t *)ctx;
+	hamt_visit_prefix(keys->hamt, prefix, depth, check_divergent_key, ctx);
+}
+
+/**
+ * Two tries with the same words added in opposite orders, then a forked
+ * copy with three changes made to it finding what differs over pipes.
+ */
+void test_case_merkle(char *contents) {
+	int count;
+	char **words = split_words(contents, &count);
+	hamt_options_t options = {
+		.flags = HAMT_DIGESTS,
+		.digest_value = string_digest
+	};
+	struct hamt_t *forwards = create_hamt_with_options(&options);
+	struct hamt_t *backwards = create_hamt_with_options(&options);
+
+	for (int i = 0; i < count; ++i) {
+		forwards = hamt_set(forwards, words[i], words[i]);
+		backwards = hamt_set(backwards, words[count - i - 1],
+				words[count - i - 1]);
+	}
+
+	printf("Merkle equal in any order: %s\n",
+			hamt_equal(forwards, backwards) ? "yes" : "no");
+	backwards = hamt_set(backwards, words[1], "changed");
+	printf("Merkle equal after a change: %s\n",
+			hamt_equal(forwards, backwards) ? "yes" : "no");
+	backwards = hamt_set(backwards, words[1], words[1]);
+	printf("Merkle equal after changing it back: %s\n",
+			hamt_equal(forwards, backwards) ? "yes" : "no");
+
+	// the last two share a hash, removing the first moves them up a level
+	struct hamt_t *colliding = create_hamt_with_options(&options);
+	struct hamt_t *expected = create_hamt_with_options(&options);
+	colliding = hamt_set(colliding, "BbabBB", "BbabBB");
+	colliding = hamt_set(colliding, "aaabb", "aaabb");
+	colliding = hamt_set(colliding, "abBbb", "abBbb");
+	colliding = hamt_remove(colliding, "BbabBB");
+	expected = hamt_set(expected, "aaabb", "aaabb");
+	expected = hamt_set(expected, "abBbb", "abBbb");
+	printf("Merkle equal after a collision moves up: %s\n",
+			hamt_equal(colliding, expected) ? "yes" : "no");
+	hamt_free(colliding);
+	hamt_free(expected);
+
+	int requests[2], replies[2];
+	if (pipe(requests) == -1 || pipe(replies) == -1) {
+		fprintf(stderr, "Failed to make pipes: %s\n", strerror(errno));
+		return;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(requests[1]);
+		close(replies[0]);
+		backwards = hamt_set(backwards, words[1], "changed");
+		backwards = hamt_remove(backwards, words[2]);
+		backwards = hamt_set(backwards, "not-a-word", "added");
+		_exit(hamt_serve_digests(backwards, requests[0], replies[1]) == 0 ?
+				EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	close(requests[0]);
+	close(replies[1]);
+
+	divergent_keys_t keys = {
+		.hamt = forwards,
+		.changed = words[1],
+		.removed = words[2],
+		.found = 0
+	};
+	long divergent = hamt_find_divergent(forwards, replies[0], requests[1],
+			diverged, &keys);
+	close(requests[1]);
+	close(replies[0]);
+	waitpid(pid, NULL, 0);
+
+	printf("Merkle divergent prefixes: %ld, changed local keys found: %d/2\n",
+			divergent, keys.found);
+	hamt_free(forwards);
+	hamt_free(backwards);
+}
+
+#define CLASH_BLOCKS 7
+#define CLASH_BLOCK_SIZE 8
+#define CLASH_KEYS   (1 << CLASH_BLOCKS)
+
+/* The same hash `hamt.c` uses */
+static unsigned int trie_hash(char *key) {
+	unsigned int hash = 0;
+
+	while (*key != '\0') {
+		hash = ((hash << 5) - hash) + *(key++);
+	}
+	return hash;
+}
+
+/**
+ * Two blocks of text whose hashes share the low 25 bits, the first five
+ * fragments. As the hash of a string is a polynomial in its characters any
+ * string made of these blocks shares them too.
+ */
+static void clash_block(char *block, unsigned int seed) {
+	for (int i = 0; i < CLASH_BLOCK_SIZE; ++i) {
+		seed = seed * 1103515245 + 12345;
+		block[i] = 'a' + (seed >> 16) % 26;
+	}
+	block[CLASH_BLOCK_SIZE] = '\0';
+}
+
+static int find_clashing_blocks(char *a, char *b) {
+	static int seen[1 << 16];
+	unsigned int mask = (1 << 25) - 1;
+
+	memset(seen, -1, sizeof(seen));
+	for (int i = 0; i < 60000; ++i) {
+		clash_block(a, i);
+		unsigned int hash = trie_hash(a);
+		unsigned int slot = hash & 0xFFFF;
+
+		for (; seen[slot] != -1; slot = (slot + 1) & 0xFFFF) {
+			clash_block(b, seen[slot]);
+			if (((trie_hash(b) ^ hash) & mask) == 0 && trie_hash(b) != hash) {
+				return 1;
+			}
+		}
+		seen[slot] = i;
+	}
+	return 0;
+}
+
+static int count_present_keys(struct hamt_t *hamt, char **keys, int n,
+		int step) {
+	int present = 0;
+
+	for (int i = 0; i < n; i += step) {
+		present += hamt_get(hamt, keys[i]) == keys[i];
+	}
+	return present;
+}
+
+/**
+ * Keys which only differ in the last couple of fragments of their hash,
+ * which sit under path nodes rather than chains of one child branches.
+ */
+void test_case_paths(void) {
+	char a[CLASH_BLOCK_SIZE + 1], b[CLASH_BLOCK_SIZE + 1];
+	char *keys[CLASH_KEYS];
+	struct hamt_t *hamt = create_hamt_flags(HAMT_FINGERPRINTS);
+
+	if (!find_clashing_blocks(a, b)) {
+		printf("Path keys: no clashing blocks found\n");
+		return;
+	}
+
+	for (int i = 0; i < CLASH_KEYS; ++i) {
+		keys[i] = (char *)malloc(CLASH_BLOCK_SIZE * CLASH_BLOCKS + 1);
+		keys[i][0] = '\0';
+		for (int block = 0; block < CLASH_BLOCKS; ++block) {
+			strcat(keys[i], (i >> block) & 1 ? b : a);
+		}
+		hamt = hamt_set(hamt, keys[i], keys[i]);
+	}
+
+	printf("Path keys with the same first 5 fragments: %d/%d\n",
+			count_present_keys(hamt, keys, CLASH_KEYS, 1), CLASH_KEYS);
+
+	for (int i = 1; i < CLASH_KEYS; i += 2) {
+		hamt = hamt_remove(hamt, keys[i]);
+	}
+	printf("Path keys after removing half: %d/%d, removed found: %d\n",
+			count_present_keys(hamt, keys, CLASH_KEYS, 2), CLASH_KEYS / 2,
+			count_present_keys(hamt, keys + 1, CLASH_KEYS - 1, 2));
+
+	hamt_batch_op_t ops[CLASH_KEYS];
+	for (int i = 0; i < CLASH_KEYS; ++i) {
+		ops[i].op = i % 3 ? HAMT_BATCH_SET : HAMT_BATCH_REMOVE;
+		ops[i].key = keys[i];
+		ops[i].value = keys[i];
+	}
+	hamt = hamt_apply_batch(hamt, ops, CLASH_KEYS);
+	printf("Path keys after a batch: %d/%d\n",
+			count_present_keys(hamt, keys, CLASH_KEYS, 1), (int)hamt_count(hamt));
+
+	for (int i = 0; i < CLASH_KEYS; ++i) {
+		hamt = hamt_remove(hamt, keys[i]);
+		free(keys[i]);
+	}
+	printf("Path keys after removing all: %zu bytes\n", hamt_bytes(hamt));
+	hamt_free(hamt);
+}
+
+#define SHARD_WRITERS 4
+
+typedef struct shard_writer_t {
+	struct hamt_sharded_t *sharded;
+	char **words;
+	int first;
+	int last;
+	pthread_t thread;
+} shard_writer_t;
+
+static void *write_shard_words(void *arg) {
+	shard_writer_t *writer = (shard_writer_t *)arg;
+
+	for (int i = writer->first; i < writer->last; ++i) {
+		hamt_sharded_set(writer->sharded, writer->words[i], writer->words[i]);
+	}
+	for (int i = writer->first; i < writer->last; i += 4) {
+		hamt_sharded_remove(writer->sharded, writer->words[i]);
+	}
+	return NULL;
+}
+
+/**
+ * Writers on their own threads, each with a slice of the words, on one
+ * shard and then spread over several.
+ */
+void test_case_sharded(char *contents) {
+	int count;
+	char **words = split_words(contents, &count);
+	struct timespec start, end;
+
+	for (int nshards = 1; nshards <= 16; nshards *= 4) {
+		struct hamt_sharded_t *sharded = create_hamt_sharded(nshards, 0);
+		shard_writer_t writers[SHARD_WRITERS];
+		hamt_sharded_stats_t stats;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < SHARD_WRITERS; ++i) {
+			writers[i].sharded = sharded;
+			writers[i].words = words;
+			writers[i].first = (long)count * i / SHARD_WRITERS;
+			writers[i].last = (long)count * (i + 1) / SHARD_WRITERS;
+			pthread_create(&writers[i].thread, NULL, write_shard_words,
+					&writers[i]);
+		}
+		for (int i = 0; i < SHARD_WRITERS; ++i) {
+			pthread_join(writers[i].thread, NULL);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		int present = 0;
+		for (int i = 0; i < count; ++i) {
+			present += hamt_sharded_get(sharded, words[i]) == words[i];
+		}
+
+		int visited = 0;
+		hamt_sharded_for_each(sharded, count_entry, &visited);
+		hamt_sharded_stats(sharded, &stats);
+		struct hamt_t *snapshot = hamt_sharded_snapshot(sharded);
+
+		printf("Sharded %2d shards: %.2fms, present %d, visited %d, "
+				"snapshot %zu\n", stats.shards, elapsed_ns(&start, &end) / 1e6,
+				present, visited, hamt_count(snapshot));
+		printf("Sharded %2d shards: %zu entries, %zu to %zu a shard\n",
+				stats.shards, stats.count, stats.min_count, stats.max_count);
+
+		hamt_free(snapshot);
+		hamt_sharded_free(sharded);
+	}
+
+	struct hamt_sharded_t *sharded = create_hamt_sharded(4, HAMT_DIGESTS);
+	struct hamt_t *direct = create_hamt_flags(HAMT_DIGESTS);
+	hamt_options_t options;
+
+	for (int i = 0; i < count && i < 1000; ++i) {
+		hamt_sharded_set(sharded, words[i], words[i]);
+		direct = hamt_set(direct, words[i], words[i]);
+	}
+
+	struct hamt_t *snapshot = hamt_sharded_snapshot(sharded);
+	hamt_get_options(snapshot, &options);
+	printf("Sharded snapshot keeps flags: %s, equal: %s\n",
+			options.flags & HAMT_DIGESTS ? "yes" : "no",
+			hamt_equal(snapshot, direct) ? "yes" : "no");
+
+	hamt_free(snapshot);
+	hamt_free(direct);
+	hamt_sharded_free(sharded);
+}
+
+/**
+ * Pretend there are two NUMA nodes with the cpus split between them, then
+ * check the updates made it to both copies.
+ */
+void test_case_replicated(char *contents) {
+	int count;
+	char **words = split_words(contents, &count);
+	hamt_topology_t topology;
+	int both = 0;
+
+	topology.nodes = 2;
+	topology.cpus = sysconf(_SC_NPROCESSORS_CONF);
+	topology.cpu_to_node = (int *)malloc(sizeof(int) * topology.cpus);
+	for (int i = 0; i < topology.cpus; ++i) {
+		topology.cpu_to_node[i] = i % 2;
+	}
+
+	struct hamt_replicated_t *replicated = create_hamt_replicated(&topology);
+
+	for (int i = 0; i < count; ++i) {
+		hamt_replicated_set(replicated, words[i], words[i]);
+	}
+	for (int i = 0; i < count; i += 2) {
+		hamt_replicated_remove(replicated, words[i]);
+	}
+	hamt_replicated_sync(replicated);
+
+	for (int i = 0; i < count; ++i) {
+		void *expected = (i % 2) ? words[i] : NULL;
+		if (hamt_replicated_get_from(replicated, 0, words[i]) == expected &&
+				hamt_replicated_get_from(replicated, 1, words[i]) == expected) {
+			both++;
+		}
+	}
+
+	printf("Replicated local node: %d\n", hamt_replicated_local_node(replicated));
+	printf("Replicated matching on both nodes: %d/%d\n", both, count);
+	printf("Replicated local lookup: %s\n",
+			(char *)hamt_replicated_get(replicated, words[1]));
+
+	hamt_replicated_free(replicated);
+
+	topology.nodes = 0;
+	printf("Replicated rejects no nodes: %s\n",
+			create_hamt_replicated(&topology) == NULL ? "yes" : "no");
+	free(topology.cpu_to_node);
+}
+
 int main(void) {
 	int fd;
 	struct stat sb;
@@ -136,11 +1136,25 @@ int main(void) {
 	}
 
 	test_case_1();
+	test_case_owned_keys();
 	test_case_2(contents);
+	bench_misses(strdup(contents));
+	bench_front_cache(strdup(contents));
+	test_case_compact(strdup(contents));
+	test_case_upsert(strdup(contents));
+	test_case_batch(strdup(contents));
+	test_case_cache(strdup(contents));
+	test_case_options(strdup(contents));
+	test_case_parallel(strdup(contents));
+	test_case_merkle(strdup(contents));
+	test_case_paths();
+	test_case_sharded(strdup(contents));
+	test_case_replicated(strdup(contents));
 
 
 	munmap(contents, sb.st_size);
 	close(fd);
+	exit(EXIT_SUCCESS);
 
 failed:
 	(void)close(fd);
@@ -27,10 +27,16 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "hamt.h"
 
@@ -38,16 +44,44 @@
 #define SIZE     32
 #define MASK     31
 
+/* Defaults, each hamt can be given its own with `create_hamt_with_options` */
 #define MIN_COLLISION_NODE_SIZE 8 // this is arbitrary, as a collision should only have
 																	// two nodes
 #define MAX_BRANCH_SIZE         16
 #define MIN_ARRAY_NODE_SIZE     8
 
+/* Owned keys shorter than this (including the '\0') live inside the leaf */
+#define INLINE_KEY_SIZE         24
+#define FINGERPRINT_BYTES       (sizeof(unsigned short) * SIZE)
+#define KEY_CHUNK_SIZE          (64 * 1024)
+#define MIN_KEY_CHUNK_SIZE      256
+
+#define CACHE_LINE_SIZE         64
+#define CACHE_WAYS              3
+#define CACHE_STAT_STRIPES      16
+
+/* Levels laid out breadth first at the start of a compacted region */
+#define COMPACT_BFS_LEVELS      2
+
+#define MIN_CLOCK_SIZE          64
+
+/* Auto tuning runs every this many writes */
+#define TUNE_INTERVAL           16384
+/* Share of operations which are lookups to trade some memory for them */
+#define TUNE_READ_HEAVY         0.9
+#define TUNE_MEMORY_SLACK       25
+/* A subtree of the root with this many times its share of lookups is hot */
+#define TUNE_HOT_FACTOR         4
+#define TUNE_MIN_LOOKUPS        1024
+/* Random walks from the root the automatic tuning estimates node sizes from */
+#define TUNE_SAMPLES            1024
+
 enum NODE_TYPE {
 	LEAF,
 	BRANCH,
 	COLLISON,
-	ARRAY_NODE
+	ARRAY_NODE,
+	PATH_NODE
 };
 
 typedef struct hamt_node_t {
@@ -55,61 +89,363 @@ typedef struct hamt_node_t {
 	unsigned int hash;
 	/**
 	 * This is only used by the collision node and array_node and is a count of
-	 * the total number of children held in the node
+	 * the total number of children held in the node. A branch keeps how many
+	 * children its array has room for, a path node how many levels it skips
+	 * and in cache mode a leaf keeps its position in the eviction clock here.
 	 */
 	int bitmap;
+	/**
+	 * Only with fingerprints, a bit is set for each fragment where the child is
+	 * a leaf or collision node and `fingerprints` holds 16 bits of its hash.
+	 */
+	unsigned int leaves;
 	char *key;
+	/**
+	 * Branch, array and collision nodes have no value, with digests on they
+	 * keep the digest of everything below them here.
+	 */
 	void *value;
 	struct hamt_node_t **children;
+	/**
+	 * Optional, for branch and array nodes. Indexed by hash fragment like the
+	 * children of an array node and stored just after the node, so checking
+	 * one is not another cache miss.
+	 */
+	unsigned short *fingerprints;
 } hamt_node_t;
 
+/**
+ * Append only storage for owned keys too long to be stored inline in a leaf.
+ * Keys never move while the chunk they are in is alive, removing a key only
+ * adds to `dead`, which is reclaimed by copying the live keys into a fresh
+ * set of chunks.
+ */
+typedef struct key_chunk_t {
+	struct key_chunk_t *next;
+	size_t used;
+	size_t size;
+	char data[];
+} key_chunk_t;
+
+typedef struct key_arena_t {
+	key_chunk_t *head;
+	size_t live;
+	size_t dead;
+	size_t chunk_size; // smaller for a small cache, chunks count in full
+} key_arena_t;
+
+/**
+ * Front cache, a set is a single cache line holding up to `CACHE_WAYS` leaves
+ * looked up by their full hash. `seq` is odd while a set is being written,
+ * a reader which sees that or sees it change goes to the trie instead.
+ */
+typedef struct cache_way_t {
+	unsigned int hash;
+	hamt_node_t *leaf;
+} cache_way_t;
+
+typedef struct cache_set_t {
+	_Alignas(CACHE_LINE_SIZE) unsigned int seq;
+	unsigned int victim;
+	cache_way_t ways[CACHE_WAYS];
+} cache_set_t;
+
+_Static_assert(sizeof(cache_set_t) == CACHE_LINE_SIZE,
+		"a cache set should fill one cache line");
+
+/**
+ * Front cache hits and misses. They are kept off the sets and spread over
+ * a few lines by thread, so readers counting them don't take lines from
+ * each other.
+ */
+typedef struct cache_stats_t {
+	_Alignas(CACHE_LINE_SIZE) unsigned long hits;
+	unsigned long misses;
+} cache_stats_t;
+
+/**
+ * A single block `hamt_compact` lays the trie out in. Nodes in it are never
+ * freed one at a time, the whole block goes at the next compaction.
+ */
+typedef struct region_t {
+	char *base;
+	size_t size;
+	size_t used;
+} region_t;
+
+/* State for compacting a subtree of the root at a time */
+typedef struct compactor_t {
+	region_t to;
+	bool active;
+	unsigned int next_frag;
+} compactor_t;
+
+/**
+ * Cache mode bookkeeping, one entry per leaf in no particular order. The hand
+ * sweeps round clearing `referenced` and evicts the first entry it finds
+ * without it, which approximates least recently used.
+ */
+typedef struct clock_entry_t {
+	hamt_node_t *leaf;
+	unsigned long expires; // milliseconds on the monotonic clock, 0 for never
+	size_t value_size;
+	bool referenced;
+} clock_entry_t;
+
+typedef struct eviction_t {
+	clock_entry_t *entries;
+	size_t capacity;
+	size_t hand;
+	size_t max_bytes;
+	void (*destroy)(void *value);
+} eviction_t;
+
+/**
+ * Auto tuning statistics. Lookups are counted by the fragment they take at the
+ * root, so the subtrees which get the most of them can be picked out.
+ */
+typedef struct tuner_t {
+	bool enabled;
+	unsigned long lookups[SIZE];
+	unsigned long writes;
+	unsigned long pending; // writes since the last time it was tuned
+	unsigned int seed;
+} tuner_t;
+
 typedef struct hamt_t {
 	hamt_node_t *root;
+	bool own_keys;
+	bool fingerprints;
+	bool bounded;
+	bool digests;
+	uint64_t (*digest_value)(void *value);
+	size_t count;
+	size_t bytes;
+	int max_branch;
+	int min_array;
+	int min_collision;
+	tuner_t tuner;
+	key_arena_t arena;
+	cache_set_t *cache;
+	cache_stats_t *cache_stats;
+	int cache_bits;
+	region_t region;
+	compactor_t compactor;
+	eviction_t clock;
+	struct fold_pool_t *pool; // threads for the parallel folds
 } hamt_t;
 
 // Insertion methods
 typedef struct insert_instruction_t {
+	hamt_t *hamt;
 	hamt_node_t *node;
 	unsigned int hash;
 	char *key;
 	void *value;
 	int depth;
+	unsigned long expires;
+	size_t value_size;
+	/**
+	 * Optional, works out the value from the one already there if there is
+	 * one. `value` is ignored when it is set.
+	 */
+	void *(*update)(void *value, int found, void *ctx);
+	void *ctx;
+	void *result; // the value the key ends up with
+	hamt_node_t *leaf; // the leaf written, NULL if nothing changed
+	hamt_node_t *found; // the leaf the key ends up in, written or not
+	uintptr_t delta; // how much the digests on the way down change by
 } insert_instruction_t;
 
 static hamt_node_t *handle_collision_insert(insert_instruction_t *ins);
 static hamt_node_t *handle_branch_insert(insert_instruction_t *ins);
 static hamt_node_t *handle_leaf_insert(insert_instruction_t *ins);
 static hamt_node_t *handle_arraynode_insert(insert_instruction_t *ins);
+static hamt_node_t *handle_path_insert(insert_instruction_t *ins);
 
 // Removal methods
 typedef struct hamt_removal_t {
+	hamt_t *hamt;
 	hamt_node_t *node;
 	unsigned int hash;
 	char *key;
 	int depth;
+	hamt_node_t *removed;
 } hamt_removal_t;
 
 static hamt_node_t *handle_collision_removal(hamt_removal_t *rem);
 static hamt_node_t *handle_branch_removal(hamt_removal_t *rem);
 static hamt_node_t *handle_leaf_removal(hamt_removal_t *rem);
 static hamt_node_t *handle_arraynode_removal(hamt_removal_t *rem);
+static hamt_node_t *handle_path_removal(hamt_removal_t *rem);
+
+static void visit_leaf_nodes(hamt_node_t *node,
+		void (*visitor)(hamt_node_t *leaf, void *ctx), void *ctx);
+static void evict(hamt_t *hamt, hamt_node_t *keep);
+static void compact_leaf_root(hamt_t *hamt);
+static void count_writes(hamt_t *hamt, size_t n);
+
+/*======= memory accounting =====================*/
+static inline bool region_contains(region_t *region, void *ptr) {
+	return (uintptr_t)ptr >= (uintptr_t)region->base &&
+		(uintptr_t)ptr < (uintptr_t)region->base + region->used;
+}
+
+/* Was `ptr` allocated by `hamt_compact` rather than malloc */
+static inline bool in_region(hamt_t *hamt, void *ptr) {
+	return region_contains(&hamt->region, ptr) ||
+		region_contains(&hamt->compactor.to, ptr);
+}
+
+/**
+ * Everything the trie allocates goes through here so `hamt->bytes` is always
+ * the size of the trie, frees have to be told the size that was allocated.
+ */
+static void *tracked_alloc(hamt_t *hamt, size_t size) {
+	void *ptr;
+
+	if ((ptr = malloc(size)) == NULL) {
+		return NULL;
+	}
+
+	hamt->bytes += size;
+	return ptr;
+}
+
+/* Anything in a region goes when the region does */
+static void tracked_free(hamt_t *hamt, void *ptr, size_t size) {
+	if (ptr == NULL || in_region(hamt, ptr)) {
+		return;
+	}
+
+	hamt->bytes -= size;
+	free(ptr);
+}
+
+/*======= owned key storage =====================*/
+/**
+ * Copy `len` bytes of `key` into the arena. Keys bigger than a chunk get a
+ * chunk to themselves which is put behind the current one, so the space left
+ * in the current chunk is not thrown away.
+ */
+static char *arena_strdup(hamt_t *hamt, char *key, size_t len) {
+	key_arena_t *arena = &hamt->arena;
+	key_chunk_t *chunk = arena->head;
+
+	if (chunk == NULL || chunk->size - chunk->used < len) {
+		size_t size = len > arena->chunk_size ? len : arena->chunk_size;
+
+		if ((chunk = (key_chunk_t *)tracked_alloc(hamt,
+						sizeof(key_chunk_t) + size)) == NULL) {
+			fprintf(stderr, "Failed to allocate memory for key chunk\n");
+			return NULL;
+		}
+
+		chunk->size = size;
+		chunk->used = 0;
+
+		if (arena->head != NULL && size > arena->chunk_size) {
+			chunk->next = arena->head->next;
+			arena->head->next = chunk;
+		} else {
+			chunk->next = arena->head;
+			arena->head = chunk;
+		}
+	}
+
+	char *ptr = chunk->data + chunk->used;
+	memcpy(ptr, key, len);
+	chunk->used += len;
+	arena->live += len;
+
+	return ptr;
+}
+
+static void free_key_chunks(hamt_t *hamt, key_chunk_t *chunk) {
+	key_chunk_t *next;
+
+	while (chunk != NULL) {
+		next = chunk->next;
+		tracked_free(hamt, chunk, sizeof(key_chunk_t) + chunk->size);
+		chunk = next;
+	}
+}
+
+/* An inline key is stored directly after the node */
+static inline bool key_is_inline(hamt_node_t *leaf) {
+	return leaf->key == (char *)(leaf + 1);
+}
+
+/**
+ * Called when a leaf leaves the trie, the arena space it used can only be
+ * given back by `compact_key_arena`.
+ */
+static void release_key(hamt_t *hamt, hamt_node_t *leaf) {
+	if (hamt->own_keys && !key_is_inline(leaf)) {
+		size_t len = strlen(leaf->key) + 1;
+		hamt->arena.live -= len;
+		hamt->arena.dead += len;
+	}
+}
+
+static void move_key(hamt_node_t *leaf, void *ctx) {
+	hamt_t *hamt = (hamt_t *)ctx;
+
+	if (!key_is_inline(leaf)) {
+		leaf->key = arena_strdup(hamt, leaf->key, strlen(leaf->key) + 1);
+	}
+}
+
+/**
+ * Copy every key still in the trie into new chunks and free the old ones.
+ * Only worth doing once at least half of the arena is dead.
+ */
+static void compact_key_arena(hamt_t *hamt) {
+	key_chunk_t *old = hamt->arena.head;
+
+	hamt->arena.head = NULL;
+	hamt->arena.live = 0;
+	hamt->arena.dead = 0;
+
+	visit_leaf_nodes(hamt->root, move_key, hamt);
+	free_key_chunks(hamt, old);
+}
 
 /*======= node constructors =====================*/
-static hamt_node_t *create_node(int hash, char *key, void *value,
-		enum NODE_TYPE type, hamt_node_t **children, unsigned long bitmap) {
+static hamt_node_t *alloc_node(hamt_t *hamt, size_t extra) {
 	hamt_node_t *node;
 
-	if ((node = (hamt_node_t *)malloc(sizeof(hamt_node_t))) == NULL) {
+	if ((node = (hamt_node_t *)tracked_alloc(hamt,
+					sizeof(hamt_node_t) + extra)) == NULL) {
 		fprintf(stderr, "failed to allocate memory for node\n");
 		return NULL;
 	}
 
+	return node;
+}
+
+static hamt_node_t *create_node(hamt_t *hamt, int hash, char *key, void *value,
+		enum NODE_TYPE type, hamt_node_t **children, unsigned long bitmap) {
+	bool fingerprinted = hamt->fingerprints &&
+		(type == BRANCH || type == ARRAY_NODE);
+	hamt_node_t *node;
+
+	if ((node = alloc_node(hamt, fingerprinted ? FINGERPRINT_BYTES : 0)) == NULL) {
+		return NULL;
+	}
+
 	node->hash     = hash;
 	node->type     = type;
 	node->key      = key;
 	node->value    = value;
 	node->children = children;
 	node->bitmap   = bitmap;
+	node->leaves   = 0;
+	node->fingerprints = NULL;
+
+	if (fingerprinted) {
+		node->fingerprints = memset(node + 1, 0, FINGERPRINT_BYTES);
+	}
 
 	return node;
 }
@@ -119,28 +455,208 @@ hamt_t *create_hamt() {
 
 	if ((hamt = (hamt_t *)malloc(sizeof(hamt_t))) == NULL) {
 		fprintf(stderr, "Failed to allocate memory for hamt\n");
+		return NULL;
 	}
 
 	hamt->root = NULL;
+	hamt->own_keys = false;
+	hamt->fingerprints = false;
+	hamt->bounded = false;
+	hamt->digests = false;
+	hamt->digest_value = NULL;
+	hamt->count = 0;
+	hamt->bytes = 0;
+	hamt->arena.head = NULL;
+	hamt->arena.live = 0;
+	hamt->arena.dead = 0;
+	hamt->arena.chunk_size = KEY_CHUNK_SIZE;
+	hamt->cache = NULL;
+	hamt->cache_stats = NULL;
+	hamt->cache_bits = 0;
+	memset(&hamt->region, 0, sizeof(region_t));
+	memset(&hamt->compactor, 0, sizeof(compactor_t));
+	memset(&hamt->clock, 0, sizeof(eviction_t));
+	hamt->pool = NULL;
+	hamt->max_branch = MAX_BRANCH_SIZE;
+	hamt->min_array = MIN_ARRAY_NODE_SIZE;
+	hamt->min_collision = MIN_COLLISION_NODE_SIZE;
+	memset(&hamt->tuner, 0, sizeof(tuner_t));
+	return hamt;
+}
+
+/**
+ * `HAMT_OWN_KEYS` copies the keys it is given, so the caller is free to reuse
+ * or free them after `hamt_set` returns.
+ *
+ * `HAMT_FINGERPRINTS` keeps 16 bits of the hash of every leaf in its parent,
+ * so most lookups for a missing key stop without touching the leaf.
+ */
+hamt_t *create_hamt_flags(int flags) {
+	hamt_t *hamt = create_hamt();
+
+	if (hamt != NULL) {
+		hamt->own_keys = flags & HAMT_OWN_KEYS;
+		hamt->fingerprints = flags & HAMT_FINGERPRINTS;
+		hamt->digests = flags & HAMT_DIGESTS;
+	}
+
+	return hamt;
+}
+
+hamt_t *create_hamt_owned() {
+	return create_hamt_flags(HAMT_OWN_KEYS);
+}
+
+/**
+ * A hamt with its own node sizes, any left as 0 get the default. With
+ * `auto_tune` they are changed as it goes to suit the mix of lookups and
+ * writes it sees, see `hamt_tune`.
+ */
+hamt_t *create_hamt_with_options(const hamt_options_t *options) {
+	int max_branch = options->max_branch_size ?
+		options->max_branch_size : MAX_BRANCH_SIZE;
+	int min_array = options->min_array_node_size ?
+		options->min_array_node_size : max_branch / 2;
+	int min_collision = options->min_collision_node_size ?
+		options->min_collision_node_size : MIN_COLLISION_NODE_SIZE;
+
+	if (max_branch > SIZE || min_array < 1 || min_array >= max_branch ||
+			min_collision < 2) {
+		fprintf(stderr, "Invalid node sizes, they need 0 < min_array_node_size "
+				"< max_branch_size <= %d and min_collision_node_size >= 2\n", SIZE);
+		return NULL;
+	}
+
+	hamt_t *hamt = create_hamt_flags(options->flags);
+
+	if (hamt != NULL) {
+		hamt->max_branch = max_branch;
+		hamt->min_array = min_array;
+		hamt->min_collision = min_collision;
+		hamt->tuner.enabled = options->auto_tune;
+		hamt->digest_value = options->digest_value;
+	}
+
 	return hamt;
 }
 
-static hamt_node_t *create_leaf(unsigned int hash, char *key, void *value) {
-	return create_node(hash, key, value, LEAF, NULL, 0);
+void hamt_get_options(hamt_t *hamt, hamt_options_t *options) {
+	options->flags = (hamt->own_keys ? HAMT_OWN_KEYS : 0) |
+		(hamt->fingerprints ? HAMT_FINGERPRINTS : 0) |
+		(hamt->digests ? HAMT_DIGESTS : 0);
+	options->max_branch_size = hamt->max_branch;
+	options->min_array_node_size = hamt->min_array;
+	options->min_collision_node_size = hamt->min_collision;
+	options->auto_tune = hamt->tuner.enabled;
+	options->digest_value = hamt->digest_value;
 }
 
-static hamt_node_t *create_collision(unsigned int hash, hamt_node_t **children,
-		int bitmap) {
-	return create_node(hash, NULL, NULL, COLLISON, children, bitmap);
+/**
+ * A hamt that holds at most `max_bytes`, counting the trie, its keys and the
+ * `value_size` given to `hamt_set_ttl`. Once over, entries that have expired
+ * or not been looked up recently are removed to make room. Keys are always
+ * owned and values belong to the hamt, `destroy` is called on each one as it
+ * is evicted, expired, removed, replaced or freed with the hamt.
+ */
+hamt_t *create_hamt_cache(int flags, size_t max_bytes,
+		void (*destroy)(void *value)) {
+	hamt_t *hamt = create_hamt_flags(flags | HAMT_OWN_KEYS);
+
+	if (hamt != NULL) {
+		size_t chunk_size = max_bytes / 16;
+
+		hamt->bounded = true;
+		hamt->clock.max_bytes = max_bytes;
+		hamt->clock.destroy = destroy;
+		// a key chunk counts against the limit before it is full
+		if (chunk_size < MIN_KEY_CHUNK_SIZE) {
+			chunk_size = MIN_KEY_CHUNK_SIZE;
+		}
+		if (chunk_size < KEY_CHUNK_SIZE) {
+			hamt->arena.chunk_size = chunk_size;
+		}
+	}
+
+	return hamt;
+}
+
+/**
+ * If the hamt owns its keys, short keys are copied to just after the node so
+ * comparing against them does not need another cache miss. Longer keys get
+ * copied into the key arena.
+ */
+static hamt_node_t *create_leaf(hamt_t *hamt, unsigned int hash, char *key,
+		void *value) {
+	if (!hamt->own_keys) {
+		return create_node(hamt, hash, key, value, LEAF, NULL, 0);
+	}
+
+	size_t len = strlen(key) + 1;
+
+	if (len > INLINE_KEY_SIZE) {
+		return create_node(hamt, hash, arena_strdup(hamt, key, len), value,
+				LEAF, NULL, 0);
+	}
+
+	hamt_node_t *node;
+
+	if ((node = alloc_node(hamt, len)) == NULL) {
+		return NULL;
+	}
+
+	node->hash     = hash;
+	node->type     = LEAF;
+	node->key      = memcpy(node + 1, key, len);
+	node->value    = value;
+	node->children = NULL;
+	node->bitmap   = 0;
+	node->leaves   = 0;
+	node->fingerprints = NULL;
+
+	return node;
+}
+
+static hamt_node_t *create_collision(hamt_t *hamt, unsigned int hash,
+		hamt_node_t **children, int bitmap) {
+	return create_node(hamt, hash, NULL, NULL, COLLISON, children, bitmap);
 }
 
-static hamt_node_t *create_branch(unsigned int hash, hamt_node_t **children) {
-	return create_node(hash, NULL, NULL, BRANCH, children, 0);
+static hamt_node_t *create_branch(hamt_t *hamt, unsigned int hash,
+		hamt_node_t **children, int capacity) {
+	return create_node(hamt, hash, NULL, NULL, BRANCH, children, capacity);
 }
 
 /* again, bitmap is size  */
-static hamt_node_t *create_arraynode(hamt_node_t **children, unsigned int bitmap) {
-	return create_node(0, NULL, NULL, ARRAY_NODE, children, bitmap);
+static hamt_node_t *create_arraynode(hamt_t *hamt, hamt_node_t **children,
+		unsigned int bitmap) {
+	return create_node(hamt, 0, NULL, NULL, ARRAY_NODE, children, bitmap);
+}
+
+/**
+ * A path node stands in for a run of `skip` branches with one child each,
+ * which all the keys below share the fragments of. `hash` is the hash of
+ * one of them and the child pointer lives just after the node. The root is
+ * never a path node.
+ */
+static hamt_node_t *create_path(hamt_t *hamt, unsigned int hash, int skip,
+		hamt_node_t *child) {
+	hamt_node_t *node;
+
+	if ((node = alloc_node(hamt, sizeof(hamt_node_t *))) == NULL) {
+		return NULL;
+	}
+
+	node->hash     = hash;
+	node->type     = PATH_NODE;
+	node->key      = NULL;
+	node->value    = NULL;
+	node->children = (hamt_node_t **)(node + 1);
+	node->children[0] = child;
+	node->bitmap   = skip;
+	node->leaves   = 0;
+	node->fingerprints = NULL;
+
+	return node;
 }
 
 static bool is_leaf(hamt_node_t *node) {
@@ -179,8 +695,13 @@ static inline unsigned int get_hash(char *str) {
 	return hash;
 }
 
+/* Fold the hash in to 16 bits */
+static inline unsigned short get_fingerprint(unsigned int hash) {
+	return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
 static inline unsigned int get_mask(unsigned int frag) {
-	return 1 << frag;
+	return 1u << frag;
 }
 
 /* take 5 bits of the hash */
@@ -196,19 +717,139 @@ static unsigned int get_position(unsigned int hash, unsigned int frag) {
 	return popcount(hash & (get_mask(frag) - 1));
 }
 
+/**
+ * Where a branch or array node keeps the child for `frag`, or NULL if there
+ * isn't one
+ */
+static hamt_node_t **child_slot(hamt_node_t *node, unsigned int frag) {
+	if (node->type == ARRAY_NODE) {
+		return &node->children[frag];
+	}
+
+	if (node->type == BRANCH && (node->hash & get_mask(frag))) {
+		return &node->children[get_position(node->hash, frag)];
+	}
+
+	return NULL;
+}
+
+/* The bits of a hash the first `depth` fragments come from */
+static inline unsigned int prefix_mask(int depth) {
+	return depth * BITS >= 32 ? ~0U : (1U << (depth * BITS)) - 1;
+}
+
+/* Does `hash` have the fragments a path node at `depth` skips over */
+static inline bool path_matches(hamt_node_t *path, unsigned int hash,
+		int depth) {
+	return ((path->hash ^ hash) & prefix_mask(depth + path->bitmap) &
+			~prefix_mask(depth)) == 0;
+}
+
 /*======= Allocators ==============*/
 /* Assign `n` number of children, at least `CAPACITY` in size */
-static hamt_node_t **alloc_children(int size) {
+static hamt_node_t **alloc_children(hamt_t *hamt, int size) {
 	hamt_node_t **children;
 
-	if ((children = (hamt_node_t **)calloc(sizeof(hamt_node_t *), size)) == NULL) {
+	if ((children = (hamt_node_t **)tracked_alloc(hamt,
+					sizeof(hamt_node_t *) * size)) == NULL) {
 		fprintf(stderr, "Failed to allocate memory for children");
 		return NULL;
 	}
 
+	memset(children, 0, sizeof(hamt_node_t *) * size);
 	return children;
 }	
 
+/**
+ * How big a new children array for a node with `count` children should be.
+ * Branches get room to grow to the hamt's `max_branch`.
+ */
+static int new_capacity(hamt_t *hamt, enum NODE_TYPE type, int count) {
+	switch (type) {
+		case BRANCH:
+			return count > hamt->max_branch ? count : hamt->max_branch;
+		case ARRAY_NODE: return SIZE;
+		case COLLISON:
+			return count > hamt->min_collision ? count : hamt->min_collision;
+		default:         return 0;
+	}
+}
+
+/**
+ * How big the children array of a node with `count` children is, outside of
+ * a region. A branch remembers, as `max_branch` may have changed since.
+ */
+static int children_capacity(hamt_t *hamt, hamt_node_t *node, int count) {
+	if (node->type == BRANCH) {
+		return node->bitmap;
+	}
+
+	return new_capacity(hamt, node->type, count);
+}
+
+/**
+ * Make sure a branch with `size` children has room for another. Children
+ * arrays in a compacted region are exactly the size of the node, and
+ * `max_branch` may have gone up since the array was made, in both cases the
+ * children are moved to a new array.
+ */
+static void grow_branch(hamt_t *hamt, hamt_node_t *branch, int size) {
+	if (!in_region(hamt, branch->children) && branch->bitmap > size) {
+		return;
+	}
+
+	int capacity = new_capacity(hamt, BRANCH, size + 1);
+	hamt_node_t **new_children = alloc_children(hamt, capacity);
+
+	memcpy(new_children, branch->children, sizeof(hamt_node_t *) * size);
+	tracked_free(hamt, branch->children, sizeof(hamt_node_t *) * branch->bitmap);
+	branch->children = new_children;
+	branch->bitmap = capacity;
+}
+
+/* Size of the node itself, with an inline key or fingerprints if it has them */
+static size_t node_size(hamt_node_t *node) {
+	if (node->fingerprints != NULL) {
+		return sizeof(hamt_node_t) + FINGERPRINT_BYTES;
+	}
+
+	if (node->type == LEAF && key_is_inline(node)) {
+		return sizeof(hamt_node_t) + strlen(node->key) + 1;
+	}
+
+	if (node->type == PATH_NODE) {
+		return sizeof(hamt_node_t) + sizeof(hamt_node_t *);
+	}
+
+	return sizeof(hamt_node_t);
+}
+
+/**
+ * Free the children array of a node, which has to be done before the count
+ * of children changes as that is what gives the size.
+ */
+static void release_children(hamt_t *hamt, hamt_node_t *node, int count) {
+	tracked_free(hamt, node->children,
+			sizeof(hamt_node_t *) * children_capacity(hamt, node, count));
+}
+
+/**
+ * Free a node without its arrays, for when they are being handed over to
+ * another node
+ */
+static void release_node(hamt_t *hamt, hamt_node_t *node) {
+	tracked_free(hamt, node, node_size(node));
+}
+
+/* Free a node and its arrays, apart from anything living in a region */
+static void free_node(hamt_t *hamt, hamt_node_t *node) {
+	if (node->children != NULL && node->type != PATH_NODE) {
+		release_children(hamt, node, node->type == BRANCH ?
+				popcount(node->hash) : node->bitmap);
+	}
+	release_node(hamt, node);
+}
+
 /*======= moving / inserting child nodes ==============*/
 /**
  * Insert child at given position
@@ -233,10 +874,10 @@ static inline void insert_child(hamt_node_t *parent, hamt_node_t *child,
 /**
  * Remove child
  */
-static inline void remove_child(hamt_node_t *parent, unsigned int position,
-		unsigned int size) {
-	int arr_size = sizeof(hamt_node_t *) * (size  - 1);
-	hamt_node_t **new_children = alloc_children(arr_size);
+static inline void remove_child(hamt_t *hamt, hamt_node_t *parent,
+		unsigned int position, unsigned int size) {
+	int capacity = new_capacity(hamt, parent->type, size - 1);
+	hamt_node_t **new_children = alloc_children(hamt, capacity);
 
 	unsigned int i = 0, j = 0;
 
@@ -248,7 +889,11 @@ static inline void remove_child(hamt_node_t *parent, unsigned int position,
 		new_children[i++] = parent->children[j++];
 	}
 
+	release_children(hamt, parent, size);
 	parent->children = new_children;
+	if (parent->type == BRANCH) {
+		parent->bitmap = capacity;
+	}
 }
 
 /**
@@ -260,55 +905,459 @@ static inline void replace_child(hamt_node_t *node, hamt_node_t *child,
 }
 
 /**
- * Function is just to split out the other methods
- * This is an atempt at polymorphism
+ * Record what lives at `frag` in a branch or array node, a no-op unless the
+ * hamt was created with `HAMT_FINGERPRINTS`
  */
-static hamt_node_t *insert(hamt_node_t *node, unsigned int hash, char *key,
-		void *value, int depth) {
-	
-	insert_instruction_t ins = {
-		.node  = node,
-		.key   = key,
-		.hash  = hash,
-		.value = value,
-		.depth = depth
-	};
+static inline void set_fingerprint(hamt_node_t *parent, unsigned int frag,
+		hamt_node_t *child) {
+	if (parent->fingerprints == NULL) {
+		return;
+	}
 
-	switch (node->type) {
-		case LEAF:       return handle_leaf_insert(&ins);
-		case BRANCH:     return handle_branch_insert(&ins);
-		case COLLISON:   return handle_collision_insert(&ins);
-		case ARRAY_NODE: return handle_arraynode_insert(&ins); 
-		default:
-			return NULL;
+	if (is_leaf(child)) {
+		parent->fingerprints[frag] = get_fingerprint(child->hash);
+		parent->leaves |= get_mask(frag);
+	} else {
+		parent->leaves &= ~get_mask(frag);
 	}
 }
 
 /**
- * If the hashes clash create a new collision node
- *
- * If the partial hashes are the same recurse
- *
- * Otherwise create a new Branch with the new hash
+ * A node taking the place of `from` in the trie takes its fingerprints too
  */
-static inline hamt_node_t *merge_leaves(unsigned int depth, unsigned int h1,
-		hamt_node_t *n1, unsigned int h2, hamt_node_t *n2) {
-	hamt_node_t **new_children = NULL;
+static inline hamt_node_t *inherit_fingerprints(hamt_node_t *node,
+		hamt_node_t *from) {
+	if (node->fingerprints != NULL) {
+		memcpy(node->fingerprints, from->fingerprints, FINGERPRINT_BYTES);
+		node->leaves = from->leaves;
+	}
+	return node;
+}
 
-	if (h1 == h2) {
-		new_children = alloc_children(MIN_COLLISION_NODE_SIZE);
-		new_children[0] = n2;
-		new_children[1] = n1;
-		return create_collision(h1, new_children, 2);
+/*======= cache mode =====================*/
+static unsigned long now_ms() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Make sure the clock has room for `extra` more entries, done before
+ * inserting so a leaf can always be given a place in it.
+ */
+static bool clock_reserve(hamt_t *hamt, size_t extra) {
+	eviction_t *clock = &hamt->clock;
+
+	if (hamt->count + extra <= clock->capacity) {
+		return true;
 	}
 
-	unsigned int sub_h1 = get_frag(h1, depth);
-	unsigned int sub_h2 = get_frag(h2, depth);
-	unsigned int new_hash = get_mask(sub_h1) | get_mask(sub_h2);
-	new_children = alloc_children(MAX_BRANCH_SIZE);
+	size_t capacity = clock->capacity ? clock->capacity : MIN_CLOCK_SIZE;
+	while (capacity < hamt->count + extra) {
+		capacity *= 2;
+	}
+
+	clock_entry_t *entries = (clock_entry_t *)realloc(clock->entries,
+			sizeof(clock_entry_t) * capacity);
+
+	if (entries == NULL) {
+		fprintf(stderr, "Failed to allocate memory for eviction clock\n");
+		return false;
+	}
+
+	hamt->bytes += sizeof(clock_entry_t) * (capacity - clock->capacity);
+	clock->entries = entries;
+	clock->capacity = capacity;
+	return true;
+}
+
+/* `hamt->count` has already been bumped for the new leaf */
+static void clock_add(hamt_t *hamt, hamt_node_t *leaf, unsigned long expires,
+		size_t value_size) {
+	clock_entry_t *entry = &hamt->clock.entries[hamt->count - 1];
+
+	leaf->bitmap = hamt->count - 1;
+	entry->leaf = leaf;
+	entry->expires = expires;
+	entry->value_size = value_size;
+	entry->referenced = true;
+	hamt->bytes += value_size;
+}
+
+/* The last entry moves in to the gap, `hamt->count` still has the old leaf */
+static void clock_remove(hamt_t *hamt, hamt_node_t *leaf) {
+	clock_entry_t *entries = hamt->clock.entries;
+	size_t last = hamt->count - 1;
+
+	hamt->bytes -= entries[leaf->bitmap].value_size;
+	entries[leaf->bitmap] = entries[last];
+	entries[leaf->bitmap].leaf->bitmap = leaf->bitmap;
+}
+
+static inline clock_entry_t *clock_entry(hamt_t *hamt, hamt_node_t *leaf) {
+	return &hamt->clock.entries[leaf->bitmap];
+}
+
+static inline bool entry_expired(clock_entry_t *entry, unsigned long now) {
+	return entry->expires != 0 && entry->expires <= now;
+}
+
+/**
+ * The value of a leaf found by `hamt_get`, unless it has expired. Lookups can
+ * run at the same time so the entry is only written to when it needs to be.
+ */
+static void *touch_entry(hamt_t *hamt, hamt_node_t *leaf) {
+	clock_entry_t *entry = clock_entry(hamt, leaf);
+
+	// expired entries stay in the trie until they are evicted
+	if (entry_expired(entry, entry->expires ? now_ms() : 0)) {
+		return NULL;
+	}
+
+	if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&entry->referenced, true, __ATOMIC_RELAXED);
+	}
+
+	return leaf->value;
+}
+
+/*======= digests =====================*/
+/* splitmix64's finaliser, spreads every bit of `x` over the whole word */
+static inline uint64_t mix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/* FNV-1a, the 32 bit hash the trie uses is too short to tell keys apart */
+static uint64_t key_digest(char *key) {
+	uint64_t digest = 0xcbf29ce484222325ULL;
+
+	while (*key != '\0') {
+		digest = (digest ^ (unsigned char)*(key++)) * 0x100000001b3ULL;
+	}
+
+	return digest;
+}
+
+/**
+ * An entry's part of the digest. Values are told apart by `digest_value`
+ * if the hamt was given one, by their address if not.
+ */
+static uintptr_t entry_digest(hamt_t *hamt, uint64_t key, void *value) {
+	uint64_t digest = hamt->digest_value != NULL ?
+		hamt->digest_value(value) : (uintptr_t)value;
+
+	return mix64(key ^ mix64(digest + 0x9e3779b97f4a7c15ULL));
+}
+
+/**
+ * Digests are the sum of the digests of the entries below, so they do not
+ * depend on the shape of the trie or the order things were added.
+ */
+static uintptr_t node_digest(hamt_t *hamt, hamt_node_t *node) {
+	if (node == NULL) {
+		return 0;
+	}
+
+	if (node->type == LEAF) {
+		return entry_digest(hamt, key_digest(node->key), node->value);
+	}
+
+	return (uintptr_t)node->value;
+}
+
+static inline void set_digest(hamt_node_t *node, uintptr_t digest) {
+	node->value = (void *)digest;
+}
+
+/* How the digest of `leaf` changed when its value went from `old_value` */
+static uintptr_t value_change(hamt_t *hamt, hamt_node_t *leaf,
+		void *old_value) {
+	if (!hamt->digests) {
+		return 0;
+	}
+
+	uint64_t key = key_digest(leaf->key);
+	return entry_digest(hamt, key, leaf->value) -
+		entry_digest(hamt, key, old_value);
+}
+
+/**
+ * Add `delta` to each node on the way down to `hash` from `node`, which
+ * are the nodes an entry with that hash has been added to or taken from.
+ * A removal can leave a collision node with another hash where the entry
+ * was, it was never below that. A path node standing in for a contracted
+ * branch took the branch's digest, so it is updated whether it matches or
+ * not.
+ */
+static void add_digest(hamt_node_t *node, unsigned int hash, int depth,
+		uintptr_t delta) {
+	while (delta != 0 && node != NULL && node->type != LEAF) {
+		if (node->type == COLLISON) {
+			if (node->hash == hash) {
+				set_digest(node, (uintptr_t)node->value + delta);
+			}
+			return;
+		}
+
+		set_digest(node, (uintptr_t)node->value + delta);
+
+		if (node->type == PATH_NODE) {
+			if (!path_matches(node, hash, depth)) {
+				return;
+			}
+			depth += node->bitmap;
+			node = node->children[0];
+			continue;
+		}
+
+		unsigned int frag = get_frag(hash, depth++);
+
+		if (node->type == ARRAY_NODE) {
+			node = node->children[frag];
+		} else if (node->hash & get_mask(frag)) {
+			node = node->children[get_position(node->hash, frag)];
+		} else {
+			return;
+		}
+	}
+}
+
+/*======= path nodes =====================*/
+/* The hash of an entry under `node`, they all share the fragments above it */
+static unsigned int subtree_hash(hamt_node_t *node) {
+	while (node->type == BRANCH || node->type == ARRAY_NODE) {
+		hamt_node_t **child = node->children;
+
+		while (*child == NULL) {
+			child++;
+		}
+		node = *child;
+	}
+
+	return node->hash;
+}
+
+/**
+ * Put a path node one level long in front of `child`, the only child left
+ * of a branch or array node below the root. If `child` is a path node
+ * already it just gets a level longer.
+ */
+static hamt_node_t *lengthen_path(hamt_t *hamt, hamt_node_t *child) {
+	if (child->type == PATH_NODE) {
+		child->bitmap++;
+		return child;
+	}
+
+	hamt_node_t *path = create_path(hamt, subtree_hash(child), 1, child);
+	path->value = child->value;
+	return path;
+}
+
+/**
+ * Take one level off the top of a path node, for when a batch splits it up.
+ * A path node one level long is freed and its child takes its place.
+ */
+static hamt_node_t *shorten_path(hamt_t *hamt, hamt_node_t *path) {
+	if (path->bitmap > 1) {
+		path->bitmap--;
+		return path;
+	}
+
+	hamt_node_t *child = path->children[0];
+	release_node(hamt, path);
+	return child;
+}
+
+/**
+ * `path` with `child` below it, after a removal under it. The path goes if
+ * there is only a leaf left, and takes in `child` if that is a path node.
+ */
+static hamt_node_t *join_path(hamt_t *hamt, hamt_node_t *path,
+		hamt_node_t *child) {
+	if (child == NULL || is_leaf(child)) {
+		release_node(hamt, path);
+		return child;
+	}
+
+	if (child->type == PATH_NODE) {
+		path->bitmap += child->bitmap;
+		path->hash = child->hash;
+		path->children[0] = child->children[0];
+		release_node(hamt, child);
+		return path;
+	}
+
+	path->children[0] = child;
+	return path;
+}
+
+/*======= inserting =====================*/
+/**
+ * Function is just to split out the other methods
+ * This is an atempt at polymorphism
+ */
+static hamt_node_t *insert(insert_instruction_t *parent, hamt_node_t *node,
+		int depth) {
+	insert_instruction_t ins = *parent;
+	hamt_node_t *new_node;
+
+	ins.node = node;
+	ins.depth = depth;
+
+	switch (node->type) {
+		case LEAF:       new_node = handle_leaf_insert(&ins); break;
+		case BRANCH:     new_node = handle_branch_insert(&ins); break;
+		case COLLISON:   new_node = handle_collision_insert(&ins); break;
+		case ARRAY_NODE: new_node = handle_arraynode_insert(&ins); break;
+		case PATH_NODE:  new_node = handle_path_insert(&ins); break;
+		default:
+			return NULL;
+	}
+
+	parent->result = ins.result;
+	parent->leaf = ins.leaf;
+	parent->found = ins.found;
+	parent->delta = ins.delta;
+	return new_node;
+}
+
+/* A leaf for a key that is not in the trie yet */
+static hamt_node_t *new_leaf(insert_instruction_t *ins) {
+	hamt_t *hamt = ins->hamt;
+
+	if (ins->update != NULL) {
+		ins->value = ins->update(NULL, 0, ins->ctx);
+	}
+
+	hamt_node_t *leaf = create_leaf(hamt, ins->hash, ins->key, ins->value);
+	ins->result = ins->value;
+	ins->leaf = leaf;
+	ins->found = leaf;
+	ins->delta = hamt->digests ? node_digest(hamt, leaf) : 0;
+
+	hamt->count++;
+	if (hamt->bounded) {
+		clock_add(hamt, leaf, ins->expires, ins->value_size);
+	}
+
+	return leaf;
+}
+
+/**
+ * The key is already in the trie, the leaf is updated where it is. An owned
+ * key is kept as it is the same string.
+ *
+ * With an update function the entry keeps its size and expiry, and is left
+ * alone if the value does not change.
+ */
+static void update_leaf(insert_instruction_t *ins, hamt_node_t *leaf) {
+	hamt_t *hamt = ins->hamt;
+	void *old_value = leaf->value;
+
+	ins->found = leaf;
+	if (ins->update != NULL) {
+		ins->result = ins->update(old_value, 1, ins->ctx);
+		if (ins->result == old_value) {
+			// still counts as a use, the caller has the value
+			if (hamt->bounded) {
+				clock_entry(hamt, leaf)->referenced = true;
+			}
+			return;
+		}
+
+		leaf->value = ins->result;
+		ins->leaf = leaf;
+		ins->delta = value_change(hamt, leaf, old_value);
+		if (hamt->bounded) {
+			clock_entry(hamt, leaf)->referenced = true;
+			if (hamt->clock.destroy != NULL) {
+				hamt->clock.destroy(old_value);
+			}
+		}
+		return;
+	}
+
+	ins->result = ins->value;
+	ins->leaf = leaf;
+	leaf->value = ins->value;
+	ins->delta = value_change(hamt, leaf, old_value);
+	if (!hamt->own_keys) {
+		leaf->key = ins->key;
+	}
+
+	if (hamt->bounded) {
+		clock_entry_t *entry = clock_entry(hamt, leaf);
+
+		hamt->bytes += ins->value_size - entry->value_size;
+		entry->value_size = ins->value_size;
+		entry->expires = ins->expires;
+		entry->referenced = true;
+
+		if (hamt->clock.destroy != NULL && old_value != ins->value) {
+			hamt->clock.destroy(old_value);
+		}
+	}
+}
+
+/**
+ * If the hashes clash create a new collision node
+ *
+ * If the partial hashes are the same a path node skips to where they
+ * differ, or at the root recurse
+ *
+ * Otherwise create a new Branch with the new hash
+ */
+static inline hamt_node_t *merge_leaves(hamt_t *hamt, unsigned int depth,
+		unsigned int h1, hamt_node_t *n1, unsigned int h2, hamt_node_t *n2) {
+	hamt_node_t **new_children = NULL;
+
+	if (h1 == h2) {
+		new_children = alloc_children(hamt, new_capacity(hamt, COLLISON, 2));
+		new_children[0] = n2;
+		new_children[1] = n1;
+		hamt_node_t *collision = create_collision(hamt, h1, new_children, 2);
+		// `n2` is new, it is added on the way back down
+		if (hamt->digests) {
+			set_digest(collision, node_digest(hamt, n1));
+		}
+		return collision;
+	}
+
+	unsigned int sub_h1 = get_frag(h1, depth);
+	unsigned int sub_h2 = get_frag(h2, depth);
+
+	if (sub_h1 == sub_h2 && depth > 0) {
+		unsigned int split = depth + 1;
+
+		while (get_frag(h1, split) == get_frag(h2, split)) {
+			split++;
+		}
+
+		hamt_node_t *path = create_path(hamt, h1, split - depth,
+				merge_leaves(hamt, split, h1, n1, h2, n2));
+		if (hamt->digests) {
+			set_digest(path, node_digest(hamt, n1));
+		}
+		return path;
+	}
+
+	unsigned int new_hash = get_mask(sub_h1) | get_mask(sub_h2);
+	int capacity = new_capacity(hamt, BRANCH, 2);
+	new_children = alloc_children(hamt, capacity);
+	hamt_node_t *branch = create_branch(hamt, new_hash, new_children, capacity);
+	if (hamt->digests) {
+		set_digest(branch, node_digest(hamt, n1));
+	}
 
 	if (sub_h1 == sub_h2) {
-		new_children[0] = merge_leaves(depth + 1, h1, n1, h2, n2);
+		new_children[0] = merge_leaves(hamt, depth + 1, h1, n1, h2, n2);
+		set_fingerprint(branch, sub_h1, new_children[0]);
+		return branch;
 	} else if (sub_h1 < sub_h2) {
 		new_children[0] = n1;
 		new_children[1] = n2;
@@ -317,29 +1366,34 @@ static inline hamt_node_t *merge_leaves(unsigned int depth, unsigned int h1,
 		new_children[1] = n1;
 	}
 
-	return create_branch(new_hash, new_children);
+	set_fingerprint(branch, sub_h1, n1);
+	set_fingerprint(branch, sub_h2, n2);
+	return branch;
 }
 
 /**
- * If what we are trying to insert matches key return a new LeafNode
+ * If what we are trying to insert matches key update the leaf
  * 
  * If we got here and there is no match we need to transform the node
  * into a branch node using 'merge_leaves'
  */
 static inline hamt_node_t *handle_leaf_insert(insert_instruction_t *ins) {
-	hamt_node_t *new_child = create_leaf(ins->hash, ins->key, ins->value);
 	if (strcmp(ins->node->key, ins->key) == 0) {
-		return new_child;
+		update_leaf(ins, ins->node);
+		return ins->node;
 	}
 
-	return merge_leaves(ins->depth, ins->node->hash, ins->node, new_child->hash,
-			new_child);
+	hamt_node_t *new_child = new_leaf(ins);
+	return merge_leaves(ins->hamt, ins->depth, ins->node->hash, ins->node,
+			new_child->hash, new_child);
 }
 
-static inline hamt_node_t *expand_branch_to_array_node(int idx, hamt_node_t *child,
-		unsigned int bitmap, hamt_node_t **children) {
+/* The same children spread out by fragment, `branch` is freed */
+static hamt_node_t *branch_to_array_node(hamt_t *hamt, hamt_node_t *branch) {
+	unsigned int bitmap = branch->hash;
+	hamt_node_t **children = branch->children;
 
-	hamt_node_t **new_children = alloc_children(SIZE);
+	hamt_node_t **new_children = alloc_children(hamt, SIZE);
 	unsigned int bit = bitmap;
 	unsigned int count = 0;
 
@@ -350,8 +1404,24 @@ static inline hamt_node_t *expand_branch_to_array_node(int idx, hamt_node_t *chi
 		bit >>= 1U;
 	}
 
-	new_children[idx] = child;
-	return create_arraynode(new_children, count+1);
+	// both are indexed by fragment so the fingerprints carry over as is
+	hamt_node_t *array_node = inherit_fingerprints(
+			create_arraynode(hamt, new_children, count), branch);
+	array_node->value = branch->value;
+
+	release_children(hamt, branch, count);
+	release_node(hamt, branch);
+	return array_node;
+}
+
+static inline hamt_node_t *expand_branch_to_array_node(hamt_t *hamt, int idx,
+		hamt_node_t *child, hamt_node_t *branch) {
+	hamt_node_t *array_node = branch_to_array_node(hamt, branch);
+
+	array_node->children[idx] = child;
+	array_node->bitmap++;
+	set_fingerprint(array_node, idx, child);
+	return array_node;
 }
 
 /**
@@ -367,60 +1437,69 @@ static inline hamt_node_t *handle_branch_insert(insert_instruction_t *ins) {
 	unsigned int mask = get_mask(frag);
 	unsigned int pos = get_position(ins->node->hash, frag);
 	bool exists = ins->node->hash & mask;
+	hamt_node_t *branch = ins->node;
 
 	if (!exists) {
-		unsigned int size = popcount(ins->node->hash);
-		hamt_node_t *new_child = create_leaf(ins->hash, ins->key, ins->value);
+		unsigned int size = popcount(branch->hash);
+		hamt_node_t *new_child = new_leaf(ins);
 		
-		if (size >= MAX_BRANCH_SIZE) {
-			return expand_branch_to_array_node(frag, new_child, ins->node->hash,
-					ins->node->children);
-		} else {
-			hamt_node_t *new_branch = create_branch(ins->node->hash | mask,
-					ins->node->children);
-			insert_child(new_branch, new_child, pos, size);
-
-			return new_branch;
+		if ((int)size >= ins->hamt->max_branch) {
+			return expand_branch_to_array_node(ins->hamt, frag, new_child, branch);
 		}
-	} else {
-		hamt_node_t *new_branch = create_branch(ins->node->hash, ins->node->children);
-		hamt_node_t *child = new_branch->children[pos];
 
-		// go to next depth, inserting a branch as the child
-		replace_child(new_branch, insert(child, ins->hash, ins->key, ins->value,
-					ins->depth + 1), pos);
-
-		return new_branch;
+		grow_branch(ins->hamt, branch, size);
+		branch->hash |= mask;
+		insert_child(branch, new_child, pos, size);
+		set_fingerprint(branch, frag, new_child);
+		return branch;
 	}
+
+	// go to next depth, inserting a branch as the child
+	replace_child(branch, insert(ins, branch->children[pos], ins->depth + 1),
+			pos);
+	set_fingerprint(branch, frag, branch->children[pos]);
+	return branch;
 }
 
 /**
  * If the key string is the same  as the one we are trying to insert then
- * replace the node.
+ * update the leaf.
  *
  * Otherwise insert the node at the end of the collision node's children
  */
 static inline hamt_node_t *handle_collision_insert(insert_instruction_t *ins) {
-	unsigned int len = ins->node->bitmap;	
-	hamt_node_t *new_child = create_leaf(ins->hash, ins->key, ins->value);
-	hamt_node_t *collision_node = create_collision(ins->node->hash,
-			ins->node->children, ins->node->bitmap);
-
-	if (ins->hash == ins->node->hash) {
-		for (int i = 0; i < collision_node->bitmap; ++i) {	
-			if (strcmp(ins->node->children[i]->key, ins->key) == 0) {
-				replace_child(ins->node, new_child, i);
+	hamt_node_t *collision_node = ins->node;
+	unsigned int len = collision_node->bitmap;	
+	hamt_node_t *new_child = NULL;
+
+	if (ins->hash == collision_node->hash) {
+		for (unsigned int i = 0; i < len; ++i) {	
+			hamt_node_t *child = collision_node->children[i];
+			if (strcmp(child->key, ins->key) == 0) {
+				update_leaf(ins, child);
 				return collision_node;
 			}
 		}
 
+		if ((int)len >= ins->hamt->min_collision || in_region(ins->hamt,
+					collision_node->children)) {
+			// out of room, move the children in to a bigger array
+			hamt_node_t **children = alloc_children(ins->hamt,
+					new_capacity(ins->hamt, COLLISON, len + 1));
+			memcpy(children, collision_node->children, sizeof(hamt_node_t *) * len);
+			release_children(ins->hamt, collision_node, len);
+			collision_node->children = children;
+		}
+
+		new_child = new_leaf(ins);
 		insert_child(collision_node, new_child, len, len);
 		collision_node->bitmap++;
 		return collision_node;
 	}
 
-	return merge_leaves(ins->depth, ins->node->hash, ins->node,
-			new_child->hash, new_child);
+	new_child = new_leaf(ins);
+	return merge_leaves(ins->hamt, ins->depth, collision_node->hash,
+			collision_node, new_child->hash, new_child);
 }
 
 /**
@@ -435,146 +1514,497 @@ static inline hamt_node_t *handle_collision_insert(insert_instruction_t *ins) {
  */
 static inline hamt_node_t *handle_arraynode_insert(insert_instruction_t *ins) {
 	unsigned int frag = get_frag(ins->hash, ins->depth);
-	int size = ins->node->bitmap;
+	hamt_node_t *array_node = ins->node;
 
-	hamt_node_t *child = ins->node->children[frag];
+	hamt_node_t *child = array_node->children[frag];
 	hamt_node_t *new_child = NULL;
 
 	if (child) {
-		new_child = insert(child, ins->hash, ins->key, ins->value, ins->depth + 1);
+		new_child = insert(ins, child, ins->depth + 1);
 	} else {
-		new_child = create_leaf(ins->hash, ins->key, ins->value);
+		new_child = new_leaf(ins);
 	}
 
-	replace_child(ins->node, new_child, frag);
+	replace_child(array_node, new_child, frag);
+	set_fingerprint(array_node, frag, new_child);
 
 	if (child == NULL && new_child != NULL) {
-		return create_arraynode(ins->node->children, size + 1);
+		array_node->bitmap++;
 	}
 
-	return create_arraynode(ins->node->children, size);
+	return array_node;
 }
 
 /**
- * Return a new node 
+ * If the key has all the fragments the path skips, carry on below it.
+ *
+ * Otherwise split the path with a branch where they first differ, holding
+ * the new leaf and the rest of the path.
  */
-hamt_t *hamt_set(hamt_t *hamt, char *key, void *value) {
-	unsigned int hash = get_hash(key);	
+static inline hamt_node_t *handle_path_insert(insert_instruction_t *ins) {
+	hamt_t *hamt = ins->hamt;
+	hamt_node_t *path = ins->node;
+	int end = ins->depth + path->bitmap;
+	int split = ins->depth;
 
-	if (hamt->root != NULL) {
-		hamt->root = insert(hamt->root, hash, key, value, 0);
-	} else {
-		hamt->root = create_leaf(hash, key, value);
+	while (split < end &&
+			get_frag(ins->hash, split) == get_frag(path->hash, split)) {
+		split++;
 	}
 
-	return hamt;
-}
-
-/**
- * Wind down the tree to the leaf node using the hash.
- */
-void *hamt_get(hamt_t *hamt, char *key) {
-	unsigned int hash = get_hash(key);
-	hamt_node_t *node = hamt->root;
-	int depth = 0;
-
-	for (;;) {
-		if (node == NULL) {
-			return NULL;
-		}
-		switch (node->type) {
-			case BRANCH: {
-				unsigned int frag = get_frag(hash, depth);
-				unsigned int mask = get_mask(frag);
+	if (split == end) {
+		path->children[0] = insert(ins, path->children[0], end);
+		return path;
+	}
 
-				if (node->hash & mask) {
-					unsigned int idx = get_position(node->hash, frag);
-					node = node->children[idx];
-					depth++;
-					continue;
-				} else {
-					return NULL;
-				}
-			}
+	hamt_node_t *rest = path->children[0];
+	if (split + 1 < end) {
+		rest = create_path(hamt, path->hash, end - split - 1, rest);
+		rest->value = path->value;
+	}
 
-			case COLLISON: {
-				int len = node->bitmap;
-				for (int i = 0; i < len; ++i) {
-					hamt_node_t *child = node->children[i];
-					if (child != NULL && strcmp(child->key, key) == 0)
-						return child->value;
-				}	
-				return NULL;
-			}
-	
-			case LEAF: {
-				if (node != NULL && strcmp(node->key, key) == 0) {
-					return node->value;
-				}
-				return NULL;
-			}
+	hamt_node_t *new_child = new_leaf(ins);
+	hamt_node_t *branch = merge_leaves(hamt, split, path->hash, rest,
+			new_child->hash, new_child);
 
-			case ARRAY_NODE: {
-				node = node->children[get_frag(hash, depth)];
-				if (node != NULL) {
-					depth++;
-					continue;
-				}
-				return NULL;
-			}
-		}	
+	if (split == ins->depth) {
+		release_node(hamt, path);
+		return branch;
 	}
+
+	path->bitmap = split - ins->depth;
+	path->children[0] = branch;
+	return path;
 }
 
-// Just to split out the functions, does nothing special
-static hamt_node_t *remove_node(hamt_removal_t *rem) {
-	if (rem->node == NULL) {
-		return NULL;
-	}
+/*======= front cache =====================*/
+static unsigned int next_stats_stripe;
+static _Thread_local int stats_stripe = -1;
 
-	switch (rem->node->type) {
-		case LEAF:       return handle_leaf_removal(rem);
-		case BRANCH:     return handle_branch_removal(rem);
-		case COLLISON:   return handle_collision_removal(rem);
-		case ARRAY_NODE: return handle_arraynode_removal(rem);
+/* The sets followed by the counters, in one block */
+static inline size_t cache_size(int bits) {
+	return (sizeof(cache_set_t) << bits) +
+		sizeof(cache_stats_t) * CACHE_STAT_STRIPES;
+}
 
-		default:
-			/* NOT REACHED  */
-			return rem->node;
+/* Each thread counts in its own stripe, handed out in turn */
+static inline cache_stats_t *cache_stats(hamt_t *hamt) {
+	if (stats_stripe < 0) {
+		stats_stripe = __atomic_fetch_add(&next_stats_stripe, 1,
+				__ATOMIC_RELAXED) % CACHE_STAT_STRIPES;
 	}
+
+	return &hamt->cache_stats[stats_stripe];
 }
 
 /**
- * Removing a child from the CollisionNode or collapsing if there is
- * only one child left.
+ * Put a small set associative cache of leaves in front of `hamt_get`, sized
+ * to the next power of two sets holding at least `entries`. Safe for any
+ * number of threads calling `hamt_get` at once, as long as they are kept
+ * apart from `hamt_set` and `hamt_remove` in the same way the trie is.
  */
-static inline hamt_node_t *handle_collision_removal(hamt_removal_t *rem) {
-	if (rem->node->hash == rem->hash) {
-		for (int i = 0; i < rem->node->bitmap; ++i) {
-			hamt_node_t *child = rem->node->children[i];
+int hamt_enable_front_cache(hamt_t *hamt, unsigned int entries) {
+	int bits = 1;
 
-			if (strcmp(child->key, rem->key) == 0) {
-				remove_child(rem->node, i, rem->node->bitmap);
-				// could free rem->node here
-				if ((rem->node->bitmap - 1) > 1) {
-					return create_collision(rem->node->hash, rem->node->children,
-							rem->node->bitmap - 1);
-				}
-				// Collapse collision node
-				return rem->node->children[0];
-			}
-		}
+	while ((1U << bits) * CACHE_WAYS < entries && bits < 24) {
+		bits++;
 	}
 
-	return rem->node;
+	size_t size = cache_size(bits);
+	cache_set_t *cache = (cache_set_t *)aligned_alloc(CACHE_LINE_SIZE, size);
+
+	if (cache == NULL) {
+		fprintf(stderr, "Failed to allocate memory for front cache\n");
+		return -1;
+	}
+
+	memset(cache, 0, size);
+	if (hamt->cache != NULL) {
+		hamt->bytes -= cache_size(hamt->cache_bits);
+		free(hamt->cache);
+	}
+	hamt->bytes += size;
+	hamt->cache = cache;
+	hamt->cache_stats = (cache_stats_t *)(cache + (1U << bits));
+	hamt->cache_bits = bits;
+	return 0;
+}
+
+static inline cache_set_t *cache_set(hamt_t *hamt, unsigned int hash) {
+	// the low bits pick the path through the trie, mix them in with the rest
+	return &hamt->cache[(hash * 2654435761U) >> (32 - hamt->cache_bits)];
+}
+
+static hamt_node_t *cache_lookup(hamt_t *hamt, unsigned int hash, char *key) {
+	cache_set_t *set = cache_set(hamt, hash);
+	unsigned int seq = __atomic_load_n(&set->seq, __ATOMIC_ACQUIRE);
+
+	if (seq & 1) {
+		goto miss;
+	}
+
+	for (int i = 0; i < CACHE_WAYS; ++i) {
+		unsigned int way_hash = __atomic_load_n(&set->ways[i].hash, __ATOMIC_RELAXED);
+		hamt_node_t *leaf = __atomic_load_n(&set->ways[i].leaf, __ATOMIC_RELAXED);
+
+		if (leaf == NULL || way_hash != hash) {
+			continue;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&set->seq, __ATOMIC_RELAXED) != seq) {
+			goto miss;
+		}
+
+		if (strcmp(leaf->key, key) == 0) {
+			__atomic_fetch_add(&cache_stats(hamt)->hits, 1, __ATOMIC_RELAXED);
+			return leaf;
+		}
+	}
+
+miss:
+	__atomic_fetch_add(&cache_stats(hamt)->misses, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* Returns with the set locked or false if another thread has it */
+static inline bool cache_lock(cache_set_t *set, unsigned int *seq) {
+	*seq = __atomic_load_n(&set->seq, __ATOMIC_RELAXED);
+
+	return !(*seq & 1) && __atomic_compare_exchange_n(&set->seq, seq, *seq + 1,
+			false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void cache_unlock(cache_set_t *set, unsigned int seq) {
+	__atomic_store_n(&set->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Remember a leaf found in the trie, skipped if another reader is already
+ * writing to the same set.
+ */
+static void cache_fill(hamt_t *hamt, hamt_node_t *leaf) {
+	cache_set_t *set = cache_set(hamt, leaf->hash);
+	unsigned int seq;
+
+	if (!cache_lock(set, &seq)) {
+		return;
+	}
+
+	cache_way_t *way = &set->ways[set->victim++ % CACHE_WAYS];
+	__atomic_store_n(&way->hash, leaf->hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&way->leaf, leaf, __ATOMIC_RELAXED);
+	cache_unlock(set, seq);
+}
+
+/**
+ * Drop every leaf with `hash`, called when the trie writes or removes one
+ * of them. Writers are exclusive so the lock is always free.
+ */
+static void cache_invalidate(hamt_t *hamt, unsigned int hash) {
+	cache_set_t *set = cache_set(hamt, hash);
+	unsigned int seq;
+
+	while (!cache_lock(set, &seq))
+		;
+
+	for (int i = 0; i < CACHE_WAYS; ++i) {
+		if (set->ways[i].hash == hash) {
+			__atomic_store_n(&set->ways[i].leaf, NULL, __ATOMIC_RELAXED);
+		}
+	}
+
+	cache_unlock(set, seq);
+}
+
+/* Forget every leaf, for when the leaves are moved */
+static void cache_clear(hamt_t *hamt) {
+	if (hamt->cache == NULL) {
+		return;
+	}
+
+	for (unsigned int i = 0; i < (1U << hamt->cache_bits); ++i) {
+		memset(hamt->cache[i].ways, 0, sizeof(hamt->cache[i].ways));
+	}
+}
+
+void hamt_front_cache_stats(hamt_t *hamt, hamt_cache_stats_t *stats) {
+	stats->hits = 0;
+	stats->misses = 0;
+	stats->hit_rate = 0;
+
+	if (hamt->cache == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < CACHE_STAT_STRIPES; ++i) {
+		stats->hits += __atomic_load_n(&hamt->cache_stats[i].hits, __ATOMIC_RELAXED);
+		stats->misses += __atomic_load_n(&hamt->cache_stats[i].misses,
+				__ATOMIC_RELAXED);
+	}
+
+	if (stats->hits + stats->misses) {
+		stats->hit_rate = (double)stats->hits / (stats->hits + stats->misses);
+	}
+}
+
+/**
+ * One walk down the trie to find or make the leaf for `ins->key`
+ */
+static void set_entry(insert_instruction_t *ins) {
+	hamt_t *hamt = ins->hamt;
+
+	if (hamt->bounded && !clock_reserve(hamt, 1)) {
+		return;
+	}
+
+	if (hamt->root != NULL) {
+		hamt->root = insert(ins, hamt->root, 0);
+	} else {
+		hamt->root = new_leaf(ins);
+	}
+	add_digest(hamt->root, ins->hash, 0, ins->delta);
+	// an upsert which kept its value leaves the cached leaf as it was
+	if (hamt->cache != NULL && ins->leaf != NULL) {
+		cache_invalidate(hamt, ins->hash);
+	}
+	compact_leaf_root(hamt);
+
+	if (hamt->bounded) {
+		evict(hamt, ins->found);
+	}
+	count_writes(hamt, 1);
+}
+
+hamt_t *hamt_set(hamt_t *hamt, char *key, void *value) {
+	return hamt_set_ttl(hamt, key, value, 0, 0);
+}
+
+/**
+ * In cache mode the entry is removed `ttl_ms` milliseconds from now, 0 being
+ * never, and `value_size` is counted towards the memory limit. Both are
+ * ignored otherwise.
+ */
+hamt_t *hamt_set_ttl(hamt_t *hamt, char *key, void *value, size_t value_size,
+		unsigned long ttl_ms) {
+	insert_instruction_t ins = {
+		.hamt  = hamt,
+		.node  = hamt->root,
+		.key   = key,
+		.hash  = get_hash(key),
+		.value = value,
+		.depth = 0,
+		.expires = ttl_ms ? now_ms() + ttl_ms : 0,
+		.value_size = value_size
+	};
+
+	set_entry(&ins);
+	return hamt;
+}
+
+/**
+ * Set `key` to whatever `fn` returns, it is given the current value and
+ * whether there was one. Returns the value `key` ends up with. Nothing is
+ * allocated or written if `fn` hands back the value it was given.
+ */
+void *hamt_upsert(hamt_t *hamt, char *key,
+		void *(*fn)(void *value, int found, void *ctx), void *ctx) {
+	insert_instruction_t ins = {
+		.hamt   = hamt,
+		.node   = hamt->root,
+		.key    = key,
+		.hash   = get_hash(key),
+		.depth  = 0,
+		.update = fn,
+		.ctx    = ctx
+	};
+
+	set_entry(&ins);
+	return ins.result;
+}
+
+static void *keep_existing(void *value, int found, void *ctx) {
+	return found ? value : ctx;
+}
+
+/**
+ * Returns the value for `key`, or inserts `value` and returns that if there
+ * isn't one.
+ */
+void *hamt_get_or_insert(hamt_t *hamt, char *key, void *value) {
+	return hamt_upsert(hamt, key, keep_existing, value);
+}
+
+/**
+ * Wind down the tree to the leaf node using the hash.
+ */
+static hamt_node_t *find_leaf(hamt_t *hamt, unsigned int hash, char *key) {
+	unsigned short fingerprint = get_fingerprint(hash);
+	hamt_node_t *node = hamt->root;
+	int depth = 0;
+
+	for (;;) {
+		if (node == NULL) {
+			return NULL;
+		}
+		switch (node->type) {
+			case BRANCH: {
+				unsigned int frag = get_frag(hash, depth);
+				unsigned int mask = get_mask(frag);
+
+				if (node->hash & mask) {
+					unsigned int idx = get_position(node->hash, frag);
+					// reject a miss without going near the leaf
+					if ((node->leaves & mask) &&
+							node->fingerprints[frag] != fingerprint) {
+						return NULL;
+					}
+					node = node->children[idx];
+					depth++;
+					continue;
+				} else {
+					return NULL;
+				}
+			}
+
+			case COLLISON: {
+				int len = node->bitmap;
+				for (int i = 0; i < len; ++i) {
+					hamt_node_t *child = node->children[i];
+					if (child != NULL && strcmp(child->key, key) == 0)
+						return child;
+				}	
+				return NULL;
+			}
+	
+			case LEAF: {
+				if (node != NULL && strcmp(node->key, key) == 0) {
+					return node;
+				}
+				return NULL;
+			}
+
+			case PATH_NODE: {
+				if (!path_matches(node, hash, depth)) {
+					return NULL;
+				}
+				depth += node->bitmap;
+				node = node->children[0];
+				continue;
+			}
+
+			case ARRAY_NODE: {
+				unsigned int frag = get_frag(hash, depth);
+				if ((node->leaves & get_mask(frag)) &&
+						node->fingerprints[frag] != fingerprint) {
+					return NULL;
+				}
+				node = node->children[frag];
+				if (node != NULL) {
+					depth++;
+					continue;
+				}
+				return NULL;
+			}
+		}	
+	}
+}
+
+void *hamt_get(hamt_t *hamt, char *key) {
+	unsigned int hash = get_hash(key);
+	hamt_node_t *leaf;
+
+	if (hamt->tuner.enabled) {
+		__atomic_fetch_add(&hamt->tuner.lookups[get_frag(hash, 0)], 1,
+				__ATOMIC_RELAXED);
+	}
+
+	if (hamt->cache == NULL) {
+		leaf = find_leaf(hamt, hash, key);
+	} else if ((leaf = cache_lookup(hamt, hash, key)) == NULL &&
+			(leaf = find_leaf(hamt, hash, key)) != NULL) {
+		cache_fill(hamt, leaf);
+	}
+
+	if (leaf == NULL) {
+		return NULL;
+	}
+
+	return hamt->bounded ? touch_entry(hamt, leaf) : leaf->value;
+}
+
+// Just to split out the functions, does nothing special
+static hamt_node_t *remove_node(hamt_removal_t *rem) {
+	if (rem->node == NULL) {
+		return NULL;
+	}
+
+	switch (rem->node->type) {
+		case LEAF:       return handle_leaf_removal(rem);
+		case BRANCH:     return handle_branch_removal(rem);
+		case COLLISON:   return handle_collision_removal(rem);
+		case ARRAY_NODE: return handle_arraynode_removal(rem);
+		case PATH_NODE:  return handle_path_removal(rem);
+
+		default:
+			/* NOT REACHED  */
+			return rem->node;
+	}
+}
+
+/**
+ * Removing a child from the CollisionNode or collapsing if there is
+ * only one child left.
+ */
+static inline hamt_node_t *handle_collision_removal(hamt_removal_t *rem) {
+	hamt_node_t *collision_node = rem->node;
+
+	if (collision_node->hash == rem->hash) {
+		for (int i = 0; i < collision_node->bitmap; ++i) {
+			hamt_node_t *child = collision_node->children[i];
+
+			if (strcmp(child->key, rem->key) == 0) {
+				rem->removed = child;
+
+				if ((collision_node->bitmap - 1) > 1) {
+					remove_child(rem->hamt, collision_node, i, collision_node->bitmap);
+					collision_node->bitmap--;
+					return collision_node;
+				}
+
+				// Collapse collision node
+				hamt_node_t *other = collision_node->children[i ^ 1];
+				free_node(rem->hamt, collision_node);
+				return other;
+			}
+		}
+	}
+
+	return collision_node;
+}
+
+/**
+ * A branch or array node down to `child`, the one child it has left. A leaf
+ * takes its place, anything else gets a path node in front of it.
+ */
+static hamt_node_t *contract_branch(hamt_t *hamt, hamt_node_t *node,
+		hamt_node_t *child) {
+	if (!is_leaf(child)) {
+		child = lengthen_path(hamt, child);
+		child->value = node->value;
+	}
+
+	free_node(hamt, node);
+	return child;
 }
 
 /**
  * Removing an element from a branch node. Either traversing down the tree,
- * collapsing the node, removing a child or a noop.
+ * collapsing or contracting the node, removing a child or a noop.
  */
 static inline hamt_node_t *handle_branch_removal(hamt_removal_t *rem) {
-	unsigned int frag = get_frag(rem->hash, rem->depth);
+	int depth = rem->depth;
+	unsigned int frag = get_frag(rem->hash, depth);
 	unsigned int mask = get_mask(frag);
 
 	hamt_node_t *branch_node = rem->node;
@@ -599,34 +2029,65 @@ static inline hamt_node_t *handle_branch_removal(hamt_removal_t *rem) {
 	if (new_child == NULL) {
 		unsigned int new_hash = branch_node->hash & ~mask;
 		if (!new_hash) {
+			free_node(rem->hamt, branch_node);
 			return NULL;
 		}
 
-		// Collapse the node
-		if (size == 2 && is_leaf(branch_node->children[pos ^ 1])) {
-			return branch_node->children[pos ^ 1];
+		// Collapse the node, or below the root contract it in to a path
+		if (size == 2 && (depth > 0 ||
+					is_leaf(branch_node->children[pos ^ 1]))) {
+			return contract_branch(rem->hamt, branch_node,
+					branch_node->children[pos ^ 1]);
 		}
 
-		remove_child(branch_node, pos, size);
-		return create_branch(new_hash, branch_node->children);
+		remove_child(rem->hamt, branch_node, pos, size);
+		branch_node->hash = new_hash;
+		set_fingerprint(branch_node, frag, NULL);
+		return branch_node;
 	}
 
 	if (size == 1 && is_leaf(new_child)) {
+		free_node(rem->hamt, branch_node);
 		return new_child;
 	}
 
 	replace_child(branch_node, new_child, pos);
-	return create_branch(branch_node->hash, branch_node->children);
+	set_fingerprint(branch_node, frag, new_child);
+	return branch_node;
 }
 
 
 /**
- * Remove the node, as a modification if you passed through a free function
- * from the top, you could then free your object here.
+ * Only the keys with the fragments the path skips can be below it, the path
+ * is joined with what is left of its child.
+ */
+static inline hamt_node_t *handle_path_removal(hamt_removal_t *rem) {
+	hamt_node_t *path = rem->node;
+	hamt_node_t *child = path->children[0];
+
+	if (!path_matches(path, rem->hash, rem->depth)) {
+		return path;
+	}
+
+	rem->node = child;
+	rem->depth += path->bitmap;
+
+	hamt_node_t *new_child = remove_node(rem);
+
+	if (child == new_child) {
+		return path;
+	}
+
+	return join_path(rem->hamt, path, new_child);
+}
+
+/**
+ * Remove the node, it is freed by `remove_entry` once the trie no longer
+ * points at it.
  */
 static inline hamt_node_t *handle_leaf_removal(hamt_removal_t *rem) {
 	if (strcmp(rem->node->key, rem->key) == 0) {
-		// could free rem->node here
+		rem->removed = rem->node;
 		return NULL;
 	}
 
@@ -637,13 +2098,15 @@ static inline hamt_node_t *handle_leaf_removal(hamt_removal_t *rem) {
  * Transform ArrayNode into a BranchNode. Setting each bit in the hash for
  * where a child is not NULL.
  *
- * We alloc MIN_ARRAY_NODE_SIZE as inorder to have got here the lower bound
- * limit for the ArrayNode must have been met.
+ * To have got here the lower bound for the ArrayNode must have been met, so
+ * the children fit in a branch of the usual size.
  */
-static inline hamt_node_t *compress_array_to_branch(unsigned int idx,
-		hamt_node_t **children) {
+static inline hamt_node_t *compress_array_to_branch(hamt_t *hamt,
+		unsigned int idx, hamt_node_t *array_node) {
+	hamt_node_t **children = array_node->children;
 
-	hamt_node_t **new_children = alloc_children(MAX_BRANCH_SIZE);
+	int capacity = new_capacity(hamt, BRANCH, array_node->bitmap - 1);
+	hamt_node_t **new_children = alloc_children(hamt, capacity);
 	hamt_node_t *child = NULL;
 	int j = 0;
 	unsigned int hash = 0;
@@ -653,23 +2116,32 @@ static inline hamt_node_t *compress_array_to_branch(unsigned int idx,
 			child = children[i];
 			if (child != NULL) {
 				new_children[j++] = child;
-				hash |= 1 << i;
+				hash |= 1u << i;
 			}
 		}
 	}
 
-	return create_branch(hash, new_children);
+	// indexed by fragment in both, so only the removed child needs clearing
+	hamt_node_t *branch = inherit_fingerprints(
+			create_branch(hamt, hash, new_children, capacity), array_node);
+	set_fingerprint(branch, idx, NULL);
+	branch->value = array_node->value;
+
+	release_children(hamt, array_node, array_node->bitmap);
+	release_node(hamt, array_node);
+	return branch;
 }
 
 /**
- * Returns a new array node with the child with key `rem->key` removed
+ * Returns the array node with the child with key `rem->key` removed
  * from the children
  *
- * Or if the total number of children is less than `MIN_ARRAY_NODE_SIZE`
+ * Or if the total number of children is down to the hamt's `min_array`
  * will compress the node to a branch node and create the branch node hash
  */
 static inline hamt_node_t *handle_arraynode_removal(hamt_removal_t *rem) {
-	unsigned int idx = get_frag(rem->hash, rem->depth);
+	int depth = rem->depth;
+	unsigned int idx = get_frag(rem->hash, depth);
 
 	// the node we are looking at
 	hamt_node_t *array_node = rem->node;
@@ -695,70 +2167,719 @@ static inline hamt_node_t *handle_arraynode_removal(hamt_removal_t *rem) {
 	}
 
 	if (child != NULL && new_child == NULL) {
-		if ((size - 1) <= MIN_ARRAY_NODE_SIZE) {
-			return compress_array_to_branch(idx, array_node->children);
+		if ((size - 1) <= rem->hamt->min_array) {
+			hamt_node_t *branch = compress_array_to_branch(rem->hamt, idx,
+					array_node);
+			// with a `min_array` of 1 there can be a child left on its own
+			if (size == 2 && (is_leaf(branch->children[0]) || depth > 0)) {
+				return contract_branch(rem->hamt, branch, branch->children[0]);
+			}
+			return branch;
 		}
 		replace_child(array_node, NULL, idx);
-		return create_arraynode(array_node->children, array_node->bitmap - 1);
+		set_fingerprint(array_node, idx, NULL);
+		array_node->bitmap--;
+		return array_node;
 	}
 
 	replace_child(array_node, new_child, idx);
-	return create_arraynode(array_node->children, array_node->bitmap);
+	set_fingerprint(array_node, idx, new_child);
+	return array_node;
 }
 
-/**
- * Remove a node from the tree, the delete happens on the leaf or collision
- * node layer.
- *
- * I've been testing this rather horribly with a counter to ensure the 466550
- * from the test dictionary actually get removed.
- */
-hamt_t *hamt_remove(hamt_t *hamt, char *key) {
-	unsigned int hash = get_hash(key);
-	hamt_removal_t rem;
-	rem.hash = hash;
-	rem.depth = 0;
-	rem.key = key;
-	rem.node = hamt->root;
+/* The last of a leaf taken out of the trie */
+static void release_leaf(hamt_t *hamt, hamt_node_t *leaf, void **taken) {
+	if (taken != NULL) {
+		*taken = leaf->value;
+	}
 
-	if (hamt->root != NULL) {
-		hamt->root = remove_node(&rem);
+	if (hamt->bounded) {
+		clock_remove(hamt, leaf);
+		if (hamt->clock.destroy != NULL && taken == NULL) {
+			hamt->clock.destroy(leaf->value);
+		}
 	}
 
-	return hamt;
+	hamt->count--;
+	release_key(hamt, leaf);
+	release_node(hamt, leaf);
 }
 
+/**
+ * Give back memory that removals have left unused, only once the trie is
+ * whole again as the key arena is compacted by walking it.
+ */
+static void tidy_after_removal(hamt_t *hamt) {
+	// the last node has gone, so has anything in a region
+	if (hamt->root == NULL) {
+		// there is nothing left for a running compaction to copy
+		hamt->bytes -= hamt->compactor.to.size;
+		free(hamt->compactor.to.base);
+		memset(&hamt->compactor, 0, sizeof(compactor_t));
 
-/*=========== Printing / visiting functions ====== */
-static void visit_all_nodes(hamt_node_t *hamt, void(*visitor)(char *key, void *value)) {
-	if (hamt) {
-		switch (hamt->type) {
-			case ARRAY_NODE:
-			case BRANCH: {
-				int len = popcount(hamt->bitmap);
-				for (int i = 0; i < len; ++i) {
-					hamt_node_t *child = hamt->children[i];
-					visit_all_nodes(child, visitor);
-				}
-				return;
-			}
-			case COLLISON: {
-				int len = popcount(hamt->bitmap);
-				for (int i = 0; i < len; ++i) {
-					hamt_node_t *child = hamt->children[i];
-					visit_all_nodes(child, visitor);
-				}
-				return;
-			}
-			case LEAF: {
-				visitor(hamt->key, hamt->value);
-			}
-		}
+		hamt->bytes -= hamt->region.size;
+		free(hamt->region.base);
+		memset(&hamt->region, 0, sizeof(region_t));
 	}
-}
 
-void visit_all(hamt_t *hamt, void (*visitor)(char *, void *)) {
-	visit_all_nodes(hamt->root, visitor);
+	if (hamt->own_keys && hamt->arena.dead >= hamt->arena.chunk_size &&
+			hamt->arena.dead > hamt->arena.live) {
+		compact_key_arena(hamt);
+	}
+}
+
+/**
+ * Take the entry for `key` out of the trie and free its leaf. The value is
+ * handed back through `taken` if it is given, otherwise in cache mode it
+ * goes to the destroy callback.
+ */
+static void remove_entry(hamt_t *hamt, unsigned int hash, char *key,
+		void **taken) {
+	hamt_removal_t rem = {
+		.hamt    = hamt,
+		.node    = hamt->root,
+		.hash    = hash,
+		.key     = key,
+		.depth   = 0,
+		.removed = NULL
+	};
+
+	if (hamt->cache != NULL) {
+		cache_invalidate(hamt, hash);
+	}
+
+	if (hamt->root != NULL) {
+		hamt->root = remove_node(&rem);
+	}
+
+	if (rem.removed != NULL) {
+		if (hamt->digests) {
+			add_digest(hamt->root, hash, 0, -node_digest(hamt, rem.removed));
+		}
+		release_leaf(hamt, rem.removed, taken);
+		compact_leaf_root(hamt);
+		tidy_after_removal(hamt);
+	}
+	count_writes(hamt, 1);
+}
+
+/**
+ * Remove a node from the tree, the delete happens on the leaf or collision
+ * node layer.
+ *
+ * I've been testing this rather horribly with a counter to ensure the 466550
+ * from the test dictionary actually get removed.
+ */
+hamt_t *hamt_remove(hamt_t *hamt, char *key) {
+	remove_entry(hamt, get_hash(key), key, NULL);
+	return hamt;
+}
+
+/**
+ * Remove `key` and hand its value back in `value`, NULL if it wasn't there.
+ * The value is the caller's, even in cache mode.
+ */
+hamt_t *hamt_remove_take(hamt_t *hamt, char *key, void **value) {
+	*value = NULL;
+	remove_entry(hamt, get_hash(key), key, value);
+	return hamt;
+}
+
+/*======= batches =====================*/
+/* Enough fragments to use up all 32 bits of the hash */
+#define MAX_DEPTH               7
+#define RADIX_BITS              7
+#define RADIX_MASK              ((1 << RADIX_BITS) - 1)
+#define SMALL_BATCH             64
+
+typedef struct batch_entry_t {
+	uint64_t order; // the fragments of the hash, the first one at the top
+	unsigned int hash;
+	size_t idx;
+} batch_entry_t;
+
+typedef struct batch_t {
+	hamt_t *hamt;
+	hamt_batch_op_t *ops;
+} batch_t;
+
+/**
+ * Sorting on this puts operations in the order a depth first walk of the
+ * trie would find them, so each subtree gets a run of them.
+ */
+static uint64_t fragment_order(unsigned int hash) {
+	uint64_t order = 0;
+
+	for (int depth = 0; depth < MAX_DEPTH; ++depth) {
+		order = (order << BITS) | get_frag(hash, depth);
+	}
+
+	return order;
+}
+
+/**
+ * Radix sort on `order`, least significant digit first. Each pass is stable
+ * so entries for the same key stay in the order they were given.
+ */
+static void sort_batch(batch_entry_t *entries, batch_entry_t *tmp, size_t n) {
+	// not worth the passes over the counts, insertion sort is stable too
+	if (n < SMALL_BATCH) {
+		for (size_t i = 1; i < n; ++i) {
+			batch_entry_t entry = entries[i];
+			size_t j = i;
+
+			while (j > 0 && entries[j - 1].order > entry.order) {
+				entries[j] = entries[j - 1];
+				j--;
+			}
+			entries[j] = entry;
+		}
+		return;
+	}
+
+	for (int shift = 0; shift < BITS * MAX_DEPTH; shift += RADIX_BITS) {
+		size_t counts[1 << RADIX_BITS] = {0};
+
+		for (size_t i = 0; i < n; ++i) {
+			counts[(entries[i].order >> shift) & RADIX_MASK]++;
+		}
+
+		size_t total = 0;
+		for (int digit = 0; digit < (1 << RADIX_BITS); ++digit) {
+			size_t count = counts[digit];
+			counts[digit] = total;
+			total += count;
+		}
+
+		for (size_t i = 0; i < n; ++i) {
+			tmp[counts[(entries[i].order >> shift) & RADIX_MASK]++] = entries[i];
+		}
+
+		memcpy(entries, tmp, sizeof(batch_entry_t) * n);
+	}
+}
+
+/* A single operation on the subtree at `node`, with the usual handlers */
+static hamt_node_t *apply_one(batch_t *batch, hamt_node_t *node,
+		batch_entry_t *entry, int depth) {
+	hamt_batch_op_t *op = &batch->ops[entry->idx];
+
+	if (op->op == HAMT_BATCH_SET) {
+		insert_instruction_t ins = {
+			.hamt  = batch->hamt,
+			.node  = node,
+			.key   = op->key,
+			.hash  = entry->hash,
+			.value = op->value,
+			.depth = depth
+		};
+
+		node = node != NULL ? insert(&ins, node, depth) : new_leaf(&ins);
+		add_digest(node, entry->hash, depth, ins.delta);
+		return node;
+	}
+
+	if (node == NULL) {
+		return NULL;
+	}
+
+	hamt_removal_t rem = {
+		.hamt    = batch->hamt,
+		.node    = node,
+		.hash    = entry->hash,
+		.key     = op->key,
+		.depth   = depth,
+		.removed = NULL
+	};
+
+	node = remove_node(&rem);
+	if (rem.removed != NULL) {
+		if (batch->hamt->digests) {
+			add_digest(node, entry->hash, depth,
+					-node_digest(batch->hamt, rem.removed));
+		}
+		release_leaf(batch->hamt, rem.removed, NULL);
+	}
+
+	return node;
+}
+
+/**
+ * Lay the children of `node` out by fragment. A path node gives up its top
+ * level, what is left of it is the only child.
+ */
+static void spread_children(hamt_t *hamt, hamt_node_t *node,
+		hamt_node_t **slots, int depth) {
+	memset(slots, 0, sizeof(hamt_node_t *) * SIZE);
+
+	if (node == NULL) {
+		return;
+	}
+
+	switch (node->type) {
+		case BRANCH: {
+			int count = 0;
+			for (unsigned int frag = 0; frag < SIZE; ++frag) {
+				if (node->hash & get_mask(frag)) {
+					slots[frag] = node->children[count++];
+				}
+			}
+			break;
+		}
+		case ARRAY_NODE:
+			memcpy(slots, node->children, sizeof(hamt_node_t *) * SIZE);
+			break;
+		case PATH_NODE:
+			slots[get_frag(node->hash, depth)] = shorten_path(hamt, node);
+			break;
+		default:
+			// a leaf or collision node becomes the only child
+			slots[get_frag(node->hash, depth)] = node;
+			break;
+	}
+}
+
+/**
+ * Turn the slots back in to one node at `depth`, reusing `node`, a branch or
+ * array node or NULL, when it can hold them. Collapses and contracts the same
+ * way removal does.
+ */
+static hamt_node_t *gather_children(hamt_t *hamt, hamt_node_t *node,
+		hamt_node_t **slots, int depth) {
+	bool interior = node != NULL && (node->type == BRANCH ||
+			node->type == ARRAY_NODE);
+	hamt_node_t *only = NULL;
+	unsigned int bitmap = 0;
+	int count = 0;
+
+	for (unsigned int frag = 0; frag < SIZE; ++frag) {
+		if (slots[frag] != NULL) {
+			bitmap |= get_mask(frag);
+			only = slots[frag];
+			count++;
+		}
+	}
+
+	if (count == 0 || (count == 1 && (is_leaf(only) || depth > 0))) {
+		if (interior) {
+			free_node(hamt, node);
+		}
+		return count == 0 || is_leaf(only) ? only : lengthen_path(hamt, only);
+	}
+
+	hamt_node_t *result;
+	bool array = count > hamt->max_branch || (interior &&
+			node->type == ARRAY_NODE && count > hamt->min_array);
+
+	if (array) {
+		if (interior && node->type == ARRAY_NODE) {
+			result = node;
+		} else {
+			result = create_arraynode(hamt, alloc_children(hamt, SIZE), 0);
+		}
+		memcpy(result->children, slots, sizeof(hamt_node_t *) * SIZE);
+		result->bitmap = count;
+	} else {
+		if (interior && node->type == BRANCH) {
+			result = node;
+			if (in_region(hamt, node->children) || node->bitmap < count) {
+				tracked_free(hamt, node->children,
+						sizeof(hamt_node_t *) * node->bitmap);
+				node->bitmap = new_capacity(hamt, BRANCH, count);
+				node->children = alloc_children(hamt, node->bitmap);
+			}
+		} else {
+			int capacity = new_capacity(hamt, BRANCH, count);
+			result = create_branch(hamt, 0, alloc_children(hamt, capacity),
+					capacity);
+		}
+		result->hash = bitmap;
+		count = 0;
+		for (unsigned int frag = 0; frag < SIZE; ++frag) {
+			if (slots[frag] != NULL) {
+				result->children[count++] = slots[frag];
+			}
+		}
+	}
+
+	if (result != node && interior) {
+		// changed between branch and array node, the fingerprints carry over
+		inherit_fingerprints(result, node);
+		release_children(hamt, node, node->type == BRANCH ?
+				popcount(node->hash) : node->bitmap);
+		release_node(hamt, node);
+	}
+
+	if (result->fingerprints != NULL) {
+		result->leaves = 0;
+		for (unsigned int frag = 0; frag < SIZE; ++frag) {
+			if (slots[frag] != NULL) {
+				set_fingerprint(result, frag, slots[frag]);
+			}
+		}
+	}
+
+	return result;
+}
+
+/* Where the run of operations for the same child as `first[0]` ends */
+static size_t run_end(batch_entry_t *first, size_t n, int depth) {
+	unsigned int frag = get_frag(first[0].hash, depth);
+	size_t j = 1;
+
+	while (j < n && get_frag(first[j].hash, depth) == frag) {
+		j++;
+	}
+
+	return j;
+}
+
+/**
+ * Apply the `n` operations starting at `first`, which all fall under `node`.
+ * Runs of operations that go to the same child are applied to it in one go.
+ * A child that is still there afterwards is swapped in place, only once one
+ * is added or removed is the node spread out and put back together.
+ */
+static hamt_node_t *apply_batch(batch_t *batch, hamt_node_t *node,
+		batch_entry_t *first, size_t n, int depth) {
+	unsigned int hash = first[0].hash;
+
+	// nothing left to split on, the single operation handlers do the rest
+	if (n == 1 || (hash == first[n - 1].hash &&
+				(node == NULL || !is_leaf(node) || node->hash == hash))) {
+		for (size_t i = 0; i < n; ++i) {
+			node = apply_one(batch, node, &first[i], depth);
+		}
+		return node;
+	}
+
+	hamt_t *hamt = batch->hamt;
+	hamt_node_t *slots[SIZE];
+	uintptr_t digest = hamt->digests ? node_digest(hamt, node) : 0;
+	size_t i = 0;
+
+	// a leaf or path is only one of the slots now, and may be gone by the end
+	bool reused = node != NULL && (node->type == BRANCH ||
+			node->type == ARRAY_NODE);
+	// a root with one child goes when that child becomes a leaf
+	bool in_place = reused && (node->type == ARRAY_NODE ||
+			popcount(node->hash) > 1);
+
+	while (in_place && i < n) {
+		unsigned int frag = get_frag(first[i].hash, depth);
+		hamt_node_t **slot = child_slot(node, frag);
+
+		if (slot == NULL || *slot == NULL) {
+			in_place = false;
+			break;
+		}
+
+		size_t j = i + run_end(&first[i], n - i, depth);
+
+		if (hamt->digests) {
+			digest -= node_digest(hamt, *slot);
+		}
+		hamt_node_t *child = apply_batch(batch, *slot, &first[i], j - i,
+				depth + 1);
+		if (hamt->digests) {
+			digest += node_digest(hamt, child);
+		}
+		// a gap is left for the rebuild below to close up
+		if (child != *slot) {
+			*slot = child;
+			set_fingerprint(node, frag, child);
+		}
+		i = j;
+
+		if (child == NULL) {
+			in_place = false;
+		}
+	}
+
+	if (in_place) {
+		if (hamt->digests) {
+			set_digest(node, digest);
+		}
+		return node;
+	}
+
+	spread_children(hamt, node, slots, depth);
+	if (!reused) {
+		node = NULL;
+	}
+
+	while (i < n) {
+		unsigned int frag = get_frag(first[i].hash, depth);
+		size_t j = i + run_end(&first[i], n - i, depth);
+
+		if (hamt->digests) {
+			digest -= node_digest(hamt, slots[frag]);
+		}
+		slots[frag] = apply_batch(batch, slots[frag], &first[i], j - i, depth + 1);
+		if (hamt->digests) {
+			digest += node_digest(hamt, slots[frag]);
+		}
+		i = j;
+	}
+
+	node = gather_children(hamt, node, slots, depth);
+	// a node left on its own already has the right digest
+	if (hamt->digests && node != NULL && !is_leaf(node)) {
+		set_digest(node, digest);
+	}
+
+	return node;
+}
+
+/**
+ * Walk every operation's path a level at a time, prefetching the node each
+ * one goes to next. Each level is a run of independent loads, so the cache
+ * misses overlap rather than being waited on one after another as a single
+ * walk down would.
+ */
+static void prefetch_paths(hamt_t *hamt, batch_entry_t *entries, size_t n,
+		hamt_node_t **nodes) {
+	for (size_t i = 0; i < n; ++i) {
+		nodes[i] = hamt->root;
+	}
+
+	for (int depth = 0; depth < MAX_DEPTH; ++depth) {
+		bool deeper = false;
+
+		for (size_t i = 0; i < n; ++i) {
+			hamt_node_t *node = nodes[i];
+			hamt_node_t **slot;
+
+			if (node == NULL) {
+				continue;
+			}
+			if (node->type == LEAF) {
+				__builtin_prefetch(node->key);
+				nodes[i] = NULL;
+				continue;
+			}
+			if ((slot = child_slot(node, get_frag(entries[i].hash, depth))) == NULL) {
+				nodes[i] = NULL;
+				continue;
+			}
+
+			__builtin_prefetch(*slot);
+			nodes[i] = *slot;
+			deeper = true;
+		}
+
+		if (!deeper) {
+			break;
+		}
+	}
+}
+
+/**
+ * Apply `n` sets and removes as if they were made one after the other. They
+ * are sorted in to trie order first so the path to each node is walked, and
+ * the node rebuilt, once however many of the operations pass through it. The
+ * paths are prefetched a level at a time before any of them are applied.
+ */
+hamt_t *hamt_apply_batch(hamt_t *hamt, hamt_batch_op_t *ops, size_t n) {
+	batch_t batch = { .hamt = hamt, .ops = ops };
+	batch_entry_t *entries;
+	size_t sets = 0;
+
+	if (n == 0) {
+		return hamt;
+	}
+
+	// the second half is room for sorting, then for the prefetch walk
+	if ((entries = (batch_entry_t *)malloc(sizeof(batch_entry_t) * n * 2)) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for batch\n");
+		return hamt;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		entries[i].hash = get_hash(ops[i].key);
+		entries[i].order = fragment_order(entries[i].hash);
+		entries[i].idx = i;
+
+		if (ops[i].op == HAMT_BATCH_SET) {
+			sets++;
+		}
+		if (hamt->cache != NULL) {
+			cache_invalidate(hamt, entries[i].hash);
+		}
+	}
+
+	if (hamt->bounded && !clock_reserve(hamt, sets)) {
+		free(entries);
+		return hamt;
+	}
+
+	sort_batch(entries, entries + n, n);
+	if (hamt->root != NULL) {
+		prefetch_paths(hamt, entries, n, (hamt_node_t **)(entries + n));
+	}
+	hamt->root = apply_batch(&batch, hamt->root, entries, n, 0);
+	free(entries);
+	compact_leaf_root(hamt);
+
+	tidy_after_removal(hamt);
+	if (hamt->bounded) {
+		evict(hamt, NULL);
+	}
+	count_writes(hamt, n);
+
+	return hamt;
+}
+
+/*======= eviction =====================*/
+static void remove_leaf(hamt_t *hamt, hamt_node_t *leaf) {
+	remove_entry(hamt, leaf->hash, leaf->key, NULL);
+}
+
+/**
+ * The bytes counted against the limit. A running compaction sets aside room
+ * for the whole trie up front, only the part it has filled so far counts.
+ */
+static size_t budget_bytes(hamt_t *hamt) {
+	region_t *to = &hamt->compactor.to;
+
+	return hamt->bytes - (to->size - to->used);
+}
+
+/**
+ * Run the clock hand round until the hamt fits in its limit again. The hand
+ * removes the first entry it comes to that has expired or not been looked up
+ * since it last passed, the others get a second chance. Expired entries
+ * further round are not looked for first, that is what `hamt_expire` is for.
+ *
+ * `keep` is the leaf just written or found, it is passed over so the value
+ * handed back to the caller is never destroyed. It is followed by its place
+ * in the clock as a removal can move the leaf itself. An entry bigger than
+ * the limit on its own stays until the next write.
+ */
+static void evict(hamt_t *hamt, hamt_node_t *keep) {
+	eviction_t *clock = &hamt->clock;
+	unsigned long now = now_ms();
+	size_t kept = keep != NULL ? (size_t)keep->bitmap : SIZE_MAX;
+
+	while (budget_bytes(hamt) > clock->max_bytes &&
+			hamt->count > (keep != NULL)) {
+		if (clock->hand >= hamt->count) {
+			clock->hand = 0;
+		}
+
+		clock_entry_t *entry = &clock->entries[clock->hand];
+
+		if (clock->hand == kept) {
+			clock->hand++;
+			continue;
+		}
+
+		if (entry->referenced && !entry_expired(entry, now)) {
+			entry->referenced = false;
+			clock->hand++;
+			continue;
+		}
+
+		// the last entry takes its place, so the hand stays where it is
+		remove_leaf(hamt, entry->leaf);
+		if (kept == hamt->count) {
+			kept = clock->hand;
+		}
+	}
+}
+
+/**
+ * Expired entries are only removed when the hamt is over its limit, this
+ * looks at up to `max` entries and removes the expired ones. Returns how many
+ * were removed.
+ */
+size_t hamt_expire(hamt_t *hamt, size_t max) {
+	eviction_t *clock = &hamt->clock;
+	unsigned long now = now_ms();
+	size_t removed = 0;
+
+	if (!hamt->bounded) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < max && hamt->count > 0; ++i) {
+		if (clock->hand >= hamt->count) {
+			clock->hand = 0;
+		}
+
+		clock_entry_t *entry = &clock->entries[clock->hand];
+
+		if (entry_expired(entry, now)) {
+			remove_leaf(hamt, entry->leaf);
+			removed++;
+		} else {
+			clock->hand++;
+		}
+	}
+
+	return removed;
+}
+
+/**
+ * The hash keys are laid out by, the trie uses it from the lowest bits up so
+ * the highest ones are free for spreading keys over several hamts.
+ */
+unsigned int hamt_hash(char *key) {
+	return get_hash(key);
+}
+
+size_t hamt_count(hamt_t *hamt) {
+	return hamt->count;
+}
+
+/**
+ * Bytes allocated for the trie, its keys and front cache, plus the value
+ * sizes given in cache mode
+ */
+size_t hamt_bytes(hamt_t *hamt) {
+	return hamt->bytes;
+}
+
+/*=========== Printing / visiting functions ====== */
+static int child_count(hamt_node_t *node) {
+	switch (node->type) {
+		case BRANCH:     return popcount(node->hash);
+		case COLLISON:   return node->bitmap;
+		case ARRAY_NODE: return SIZE;
+		case PATH_NODE:  return 1;
+		default:         return 0;
+	}
+}
+
+static void visit_leaf_nodes(hamt_node_t *node,
+		void (*visitor)(hamt_node_t *leaf, void *ctx), void *ctx) {
+	if (node == NULL) {
+		return;
+	}
+
+	if (node->type == LEAF) {
+		visitor(node, ctx);
+		return;
+	}
+
+	// ArrayNode children are sparse, NULL is skipped above
+	int len = child_count(node);
+	for (int i = 0; i < len; ++i) {
+		visit_leaf_nodes(node->children[i], visitor, ctx);
+	}
+}
+
+typedef struct visit_ctx_t {
+	void (*visitor)(char *key, void *value);
+} visit_ctx_t;
+
+static void visit_key_value(hamt_node_t *leaf, void *ctx) {
+	((visit_ctx_t *)ctx)->visitor(leaf->key, leaf->value);
+}
+
+void visit_all(hamt_t *hamt, void (*visitor)(char *, void *)) {
+	visit_ctx_t ctx = { .visitor = visitor };
+	visit_leaf_nodes(hamt->root, visit_key_value, &ctx);
 }
 
 static void print_node(char *key, void *value) {
@@ -769,3 +2890,1329 @@ static void print_node(char *key, void *value) {
 void print_hamt(hamt_t *hamt) {
 	visit_all(hamt, print_node);
 }
+
+/*=========== Parallel folds ====== */
+#define MIN_TASK_QUEUE_SIZE 64
+
+/**
+ * Subtrees waiting to be walked. The worker which owns the queue takes the
+ * one it added last, as it is likely to still be in its cache, others steal
+ * the oldest, which being nearer the root is likely to be bigger.
+ */
+typedef struct task_queue_t {
+	_Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+	hamt_node_t **nodes;
+	int head;
+	int tail;
+	int capacity;
+} task_queue_t;
+
+typedef struct fold_t {
+	task_queue_t *queues;
+	int nthreads;
+	int idle;     // workers with nothing to do, subtrees are only split for them
+	long pending; // subtrees queued or being walked
+	long queued;  // subtrees in a queue
+	// workers with nothing to do sleep on `work` until something is queued
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	int sleeping;
+	void *(*map)(char *key, void *value, void *acc);
+	void (*each)(char *key, void *value, void *ctx);
+	void *ctx;
+} fold_t;
+
+typedef struct worker_t {
+	fold_t *fold;
+	int id;
+	unsigned int seed;
+	bool found;
+	void *acc;
+} worker_t;
+
+/**
+ * Threads kept by a hamt for its folds, made the first time they are needed
+ * and joined by `hamt_free`. Between folds they sleep on `wake`. Each fold
+ * bumps `round` and the threads it needs join in as workers 1 and up, the
+ * calling thread being worker 0. Folds from different threads take turns.
+ */
+typedef struct fold_pool_t {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done; // a fold finished, or its workers did
+	pthread_t *threads;
+	int len;
+	int claimed;         // threads which have picked their index
+	unsigned long round;
+	fold_t *fold;        // the fold running, if there is one
+	worker_t *workers;
+	int running;         // threads still working on `fold`
+	bool stop;
+} fold_pool_t;
+
+/* False if there was no room, the caller walks the subtree itself */
+static bool push_task(worker_t *worker, hamt_node_t *node) {
+	fold_t *fold = worker->fold;
+	task_queue_t *queue = &fold->queues[worker->id];
+
+	__atomic_add_fetch(&fold->pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->tail == queue->capacity) {
+		int capacity = queue->capacity ? queue->capacity * 2 : MIN_TASK_QUEUE_SIZE;
+		hamt_node_t **nodes = (hamt_node_t **)realloc(queue->nodes,
+				sizeof(hamt_node_t *) * capacity);
+
+		if (nodes == NULL) {
+			pthread_mutex_unlock(&queue->lock);
+			__atomic_sub_fetch(&fold->pending, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+		queue->nodes = nodes;
+		queue->capacity = capacity;
+	}
+
+	queue->nodes[queue->tail++] = node;
+	pthread_mutex_unlock(&queue->lock);
+
+	// pairs with `wait_for_task`, one of the two sees the other
+	__atomic_add_fetch(&fold->queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&fold->sleeping, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&fold->lock);
+		pthread_cond_signal(&fold->work);
+		pthread_mutex_unlock(&fold->lock);
+	}
+	return true;
+}
+
+static hamt_node_t *pop_task(task_queue_t *queue, bool steal) {
+	hamt_node_t *node = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head < queue->tail) {
+		node = steal ? queue->nodes[queue->head++] : queue->nodes[--queue->tail];
+		if (queue->head == queue->tail) {
+			queue->head = queue->tail = 0;
+		}
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return node;
+}
+
+/* Its own work first, then from the others starting at a random one */
+static hamt_node_t *take_task(worker_t *worker) {
+	fold_t *fold = worker->fold;
+	hamt_node_t *node = pop_task(&fold->queues[worker->id], false);
+	int start = rand_r(&worker->seed) % fold->nthreads;
+
+	for (int i = 0; node == NULL && i < fold->nthreads; ++i) {
+		int victim = (start + i) % fold->nthreads;
+
+		if (victim != worker->id) {
+			node = pop_task(&fold->queues[victim], true);
+		}
+	}
+
+	if (node != NULL) {
+		__atomic_sub_fetch(&fold->queued, 1, __ATOMIC_SEQ_CST);
+	}
+	return node;
+}
+
+/**
+ * Sleep until something is queued. Returns false once every subtree has
+ * been walked, the worker is done.
+ */
+static bool wait_for_task(fold_t *fold) {
+	bool more;
+
+	pthread_mutex_lock(&fold->lock);
+	__atomic_add_fetch(&fold->sleeping, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&fold->queued, __ATOMIC_SEQ_CST) == 0 &&
+			__atomic_load_n(&fold->pending, __ATOMIC_SEQ_CST) != 0) {
+		pthread_cond_wait(&fold->work, &fold->lock);
+	}
+	more = __atomic_load_n(&fold->pending, __ATOMIC_ACQUIRE) != 0;
+	__atomic_sub_fetch(&fold->sleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&fold->lock);
+
+	return more;
+}
+
+/**
+ * Walk a subtree, handing the branches and array nodes below `node` out as
+ * tasks of their own while other workers have nothing to do.
+ */
+static void fold_node(worker_t *worker, hamt_node_t *node) {
+	fold_t *fold = worker->fold;
+
+	if (node->type == LEAF) {
+		if (fold->each != NULL) {
+			fold->each(node->key, node->value, fold->ctx);
+		} else {
+			worker->acc = fold->map(node->key, node->value, worker->acc);
+			worker->found = true;
+		}
+		return;
+	}
+
+	bool split = node->type != COLLISON &&
+		__atomic_load_n(&fold->idle, __ATOMIC_RELAXED) > 0;
+	int len = child_count(node);
+
+	for (int i = 0; i < len; ++i) {
+		hamt_node_t *child = node->children[i];
+
+		if (child == NULL) {
+			continue;
+		}
+
+		if (!split || is_leaf(child) || !push_task(worker, child)) {
+			fold_node(worker, child);
+		}
+	}
+}
+
+static void fold_worker(worker_t *worker) {
+	fold_t *fold = worker->fold;
+	// everyone but the first starts out idle, so the root gets split
+	bool idle = worker->id != 0;
+	hamt_node_t *node;
+
+	for (;;) {
+		if ((node = take_task(worker)) != NULL) {
+			if (idle) {
+				__atomic_sub_fetch(&fold->idle, 1, __ATOMIC_RELAXED);
+				idle = false;
+			}
+			fold_node(worker, node);
+
+			// the last subtree is done, wake everyone so they can leave
+			if (__atomic_sub_fetch(&fold->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+				pthread_mutex_lock(&fold->lock);
+				pthread_cond_broadcast(&fold->work);
+				pthread_mutex_unlock(&fold->lock);
+			}
+			continue;
+		}
+
+		if (!idle) {
+			__atomic_add_fetch(&fold->idle, 1, __ATOMIC_RELAXED);
+			idle = true;
+		}
+
+		if (!wait_for_task(fold)) {
+			return;
+		}
+	}
+}
+
+static void *pool_thread(void *arg) {
+	fold_pool_t *pool = (fold_pool_t *)arg;
+	unsigned long seen = 0;
+	int index;
+
+	pthread_mutex_lock(&pool->lock);
+	index = pool->claimed++;
+
+	for (;;) {
+		while (!pool->stop && (pool->fold == NULL || pool->round == seen)) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		if (pool->stop) {
+			break;
+		}
+
+		seen = pool->round;
+		if (index + 1 >= pool->fold->nthreads) {
+			continue;
+		}
+
+		worker_t *worker = &pool->workers[index + 1];
+		pthread_mutex_unlock(&pool->lock);
+		fold_worker(worker);
+		pthread_mutex_lock(&pool->lock);
+
+		if (--pool->running == 0) {
+			pthread_cond_broadcast(&pool->done);
+		}
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/**
+ * The hamt's pool with at least `want` threads if they can be started,
+ * locked and with no fold running. NULL if there was not the memory.
+ */
+static fold_pool_t *lock_pool(hamt_t *hamt, int want) {
+	fold_pool_t *pool = __atomic_load_n(&hamt->pool, __ATOMIC_ACQUIRE);
+
+	if (pool == NULL) {
+		fold_pool_t *expected = NULL;
+
+		if ((pool = (fold_pool_t *)calloc(1, sizeof(fold_pool_t))) == NULL) {
+			fprintf(stderr, "Failed to allocate memory for fold pool\n");
+			return NULL;
+		}
+		pthread_mutex_init(&pool->lock, NULL);
+		pthread_cond_init(&pool->wake, NULL);
+		pthread_cond_init(&pool->done, NULL);
+
+		// folds can overlap each other, only one pool gets kept
+		if (!__atomic_compare_exchange_n(&hamt->pool, &expected, pool, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			pthread_cond_destroy(&pool->done);
+			pthread_cond_destroy(&pool->wake);
+			pthread_mutex_destroy(&pool->lock);
+			free(pool);
+			pool = expected;
+		}
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->fold != NULL) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+
+	if (pool->len < want) {
+		pthread_t *threads = (pthread_t *)realloc(pool->threads,
+				sizeof(pthread_t) * want);
+
+		// a thread which can't be started leaves its share to the others
+		if (threads != NULL) {
+			pool->threads = threads;
+			while (pool->len < want && pthread_create(&pool->threads[pool->len],
+						NULL, pool_thread, pool) == 0) {
+				pool->len++;
+			}
+		}
+	}
+
+	return pool;
+}
+
+static void free_pool(fold_pool_t *pool) {
+	if (pool == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->len; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+/**
+ * Run `fold` over the trie on `nthreads` threads, the calling thread being
+ * one of them and the rest from the hamt's pool. Returns false if there was
+ * not the memory to try.
+ */
+static bool run_fold(hamt_t *hamt, fold_t *fold, worker_t **workers,
+		int nthreads) {
+	fold_pool_t *pool = NULL;
+
+	if (nthreads <= 0) {
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = nthreads > 0 ? nthreads : 1;
+	}
+
+	if (nthreads > 1) {
+		if ((pool = lock_pool(hamt, nthreads - 1)) == NULL) {
+			return false;
+		}
+		if (nthreads > pool->len + 1) {
+			nthreads = pool->len + 1;
+		}
+	}
+
+	fold->nthreads = nthreads;
+	fold->idle = nthreads - 1;
+	fold->pending = 0;
+	fold->queued = 0;
+	fold->sleeping = 0;
+	fold->queues = (task_queue_t *)aligned_alloc(CACHE_LINE_SIZE,
+			sizeof(task_queue_t) * nthreads);
+	*workers = (worker_t *)calloc(nthreads, sizeof(worker_t));
+
+	if (fold->queues == NULL || *workers == NULL) {
+		fprintf(stderr, "Failed to allocate memory for parallel fold\n");
+		free(fold->queues);
+		free(*workers);
+		if (pool != NULL) {
+			pthread_mutex_unlock(&pool->lock);
+		}
+		return false;
+	}
+
+	pthread_mutex_init(&fold->lock, NULL);
+	pthread_cond_init(&fold->work, NULL);
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_mutex_init(&fold->queues[i].lock, NULL);
+		fold->queues[i].nodes = NULL;
+		fold->queues[i].head = 0;
+		fold->queues[i].tail = 0;
+		fold->queues[i].capacity = 0;
+		(*workers)[i].fold = fold;
+		(*workers)[i].id = i;
+		(*workers)[i].seed = i + 1;
+	}
+
+	bool queued = push_task(&(*workers)[0], hamt->root);
+
+	if (pool != NULL) {
+		pool->fold = fold;
+		pool->workers = *workers;
+		pool->running = nthreads - 1;
+		pool->round++;
+		pthread_cond_broadcast(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (queued) {
+		fold_worker(&(*workers)[0]);
+	} else {
+		fold_node(&(*workers)[0], hamt->root);
+	}
+
+	if (pool != NULL) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->running > 0) {
+			pthread_cond_wait(&pool->done, &pool->lock);
+		}
+		pool->fold = NULL;
+		pool->workers = NULL;
+		// let the next fold in
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_mutex_destroy(&fold->queues[i].lock);
+		free(fold->queues[i].nodes);
+	}
+	pthread_cond_destroy(&fold->work);
+	pthread_mutex_destroy(&fold->lock);
+	free(fold->queues);
+	return true;
+}
+
+/**
+ * Fold every entry in to one value on `nthreads` threads, or one per cpu if
+ * it is 0. Each thread starts with a NULL accumulator and calls `map` with
+ * each entry it is given and the accumulator so far, `map` returns the new
+ * one. The accumulators of the threads which were given any entries are put
+ * together with `combine`, in no particular order. Returns NULL if the hamt
+ * is empty.
+ *
+ * Like `hamt_get` it must not overlap with anything changing the hamt.
+ */
+void *hamt_parallel_fold(hamt_t *hamt,
+		void *(*map)(char *key, void *value, void *acc),
+		void *(*combine)(void *left, void *right), int nthreads) {
+	fold_t fold = { .map = map };
+	worker_t *workers;
+	void *result = NULL;
+	bool found = false;
+
+	if (hamt->root == NULL || !run_fold(hamt, &fold, &workers, nthreads)) {
+		return NULL;
+	}
+
+	for (int i = 0; i < fold.nthreads; ++i) {
+		if (!workers[i].found) {
+			continue;
+		}
+		result = found ? combine(result, workers[i].acc) : workers[i].acc;
+		found = true;
+	}
+
+	free(workers);
+	return result;
+}
+
+/**
+ * Call `fn` with every entry on `nthreads` threads, or one per cpu if it is
+ * 0. `fn` is called from all of them at once.
+ */
+void hamt_parallel_for_each(hamt_t *hamt,
+		void (*fn)(char *key, void *value, void *ctx), void *ctx, int nthreads) {
+	fold_t fold = { .each = fn, .ctx = ctx };
+	worker_t *workers;
+
+	if (hamt->root != NULL && run_fold(hamt, &fold, &workers, nthreads)) {
+		free(workers);
+	}
+}
+
+/*=========== Digests ====== */
+typedef struct digest_request_t {
+	uint32_t prefix;
+	int32_t depth; // -1 to finish
+} digest_request_t;
+
+/* For each fragment one further down than the request */
+typedef struct digest_reply_t {
+	uint64_t digests[SIZE];
+	uint32_t interior; // bit set where there is a branch or array node
+} digest_reply_t;
+
+typedef struct digest_sum_t {
+	hamt_t *hamt;
+	uintptr_t digest;
+} digest_sum_t;
+
+static void add_entry_digest(hamt_node_t *leaf, void *ctx) {
+	digest_sum_t *sum = (digest_sum_t *)ctx;
+	sum->digest += node_digest(sum->hamt, leaf);
+}
+
+/**
+ * A digest of every key and value, which is the same for two hamts with
+ * the same entries whatever order they were added in. Kept up to date as
+ * it changes with `HAMT_DIGESTS`, worked out from every entry without.
+ */
+uint64_t hamt_digest(hamt_t *hamt) {
+	if (hamt->digests) {
+		return node_digest(hamt, hamt->root);
+	}
+
+	digest_sum_t sum = { .hamt = hamt, .digest = 0 };
+	visit_leaf_nodes(hamt->root, add_entry_digest, &sum);
+	return sum.digest;
+}
+
+typedef struct equal_ctx_t {
+	hamt_t *hamt;
+	hamt_t *other;
+	bool equal;
+} equal_ctx_t;
+
+static void compare_entry(hamt_node_t *leaf, void *ctx) {
+	equal_ctx_t *equal = (equal_ctx_t *)ctx;
+	hamt_t *hamt = equal->hamt;
+
+	if (!equal->equal) {
+		return;
+	}
+
+	hamt_node_t *other = find_leaf(equal->other, leaf->hash, leaf->key);
+
+	if (other == NULL) {
+		equal->equal = false;
+	} else if (hamt->digest_value != NULL) {
+		equal->equal = hamt->digest_value(leaf->value) ==
+			hamt->digest_value(other->value);
+	} else {
+		equal->equal = leaf->value == other->value;
+	}
+}
+
+/**
+ * Do both have the same keys with the same values. Only the root digests
+ * are compared if both have `HAMT_DIGESTS` and the same `digest_value`,
+ * otherwise each entry of `a` is looked up in `b`.
+ */
+int hamt_equal(hamt_t *a, hamt_t *b) {
+	if (a->count != b->count) {
+		return 0;
+	}
+
+	if (a->digests && b->digests && a->digest_value == b->digest_value) {
+		return node_digest(a, a->root) == node_digest(b, b->root);
+	}
+
+	equal_ctx_t ctx = { .hamt = a, .other = b, .equal = true };
+	visit_leaf_nodes(a->root, compare_entry, &ctx);
+	return ctx.equal;
+}
+
+static bool matches_prefix(hamt_node_t *node, unsigned int prefix, int depth) {
+	return ((node->hash ^ prefix) & prefix_mask(depth)) == 0;
+}
+
+/**
+ * The node everything with a hash starting with the first `depth` fragments
+ * of `prefix` is under. A leaf or collision node can be found before then,
+ * which might not start with them.
+ */
+static hamt_node_t *find_prefix(hamt_t *hamt, unsigned int prefix, int depth) {
+	hamt_node_t *node = hamt->root;
+	int level = 0;
+
+	while (level < depth && node != NULL && !is_leaf(node)) {
+		unsigned int frag = get_frag(prefix, level);
+
+		if (node->type == PATH_NODE) {
+			int end = level + node->bitmap;
+
+			// the prefix can run out part way along
+			for (; level < end && level < depth; ++level) {
+				if (get_frag(node->hash, level) != get_frag(prefix, level)) {
+					return NULL;
+				}
+			}
+			if (level < end) {
+				return node;
+			}
+			node = node->children[0];
+			continue;
+		}
+
+		if (node->type == ARRAY_NODE) {
+			node = node->children[frag];
+		} else if (node->hash & get_mask(frag)) {
+			node = node->children[get_position(node->hash, frag)];
+		} else {
+			node = NULL;
+		}
+		level++;
+	}
+
+	return node;
+}
+
+static uintptr_t prefix_digest(hamt_t *hamt, unsigned int prefix, int depth) {
+	hamt_node_t *node = find_prefix(hamt, prefix, depth);
+
+	if (node == NULL || (is_leaf(node) && !matches_prefix(node, prefix, depth))) {
+		return 0;
+	}
+
+	return node_digest(hamt, node);
+}
+
+/* False for fragments past the end of the hash on the last level */
+static bool child_prefix(unsigned int prefix, unsigned int frag, int depth,
+		unsigned int *child) {
+	unsigned int shift = BITS * depth;
+
+	if (shift >= 32 || ((frag << shift) >> shift) != frag) {
+		return false;
+	}
+
+	*child = prefix | (frag << shift);
+	return true;
+}
+
+static int read_full(int fd, void *buf, size_t size) {
+	char *ptr = (char *)buf;
+
+	while (size > 0) {
+		ssize_t got = read(fd, ptr, size);
+
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return -1;
+		}
+		ptr += got;
+		size -= got;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, void *buf, size_t size) {
+	char *ptr = (char *)buf;
+
+	while (size > 0) {
+		ssize_t wrote = write(fd, ptr, size);
+
+		if (wrote < 0 && errno == EINTR) {
+			continue;
+		}
+		if (wrote <= 0) {
+			return -1;
+		}
+		ptr += wrote;
+		size -= wrote;
+	}
+
+	return 0;
+}
+
+/**
+ * Answer `hamt_find_divergent` running against another copy of the hamt,
+ * until it is done. Returns 0 then, or -1 if the other end went away or
+ * the hamt has no digests.
+ *
+ * The messages are sent as they are in memory, so both ends have to be
+ * built the same way.
+ */
+int hamt_serve_digests(hamt_t *hamt, int in_fd, int out_fd) {
+	digest_request_t request;
+
+	if (!hamt->digests) {
+		fprintf(stderr, "Serving digests needs a hamt made with HAMT_DIGESTS\n");
+		return -1;
+	}
+
+	while (read_full(in_fd, &request, sizeof(request)) == 0) {
+		if (request.depth < 0) {
+			return 0;
+		}
+
+		digest_reply_t reply;
+		memset(&reply, 0, sizeof(reply));
+
+		for (unsigned int frag = 0; frag < SIZE; ++frag) {
+			unsigned int child;
+
+			if (request.depth >= MAX_DEPTH ||
+					!child_prefix(request.prefix, frag, request.depth, &child)) {
+				continue;
+			}
+
+			hamt_node_t *node = find_prefix(hamt, child, request.depth + 1);
+			reply.digests[frag] = prefix_digest(hamt, child, request.depth + 1);
+			if (node != NULL && !is_leaf(node)) {
+				reply.interior |= get_mask(frag);
+			}
+		}
+
+		if (write_full(out_fd, &reply, sizeof(reply)) != 0) {
+			return -1;
+		}
+	}
+
+	return -1;
+}
+
+typedef struct divergence_t {
+	hamt_t *hamt;
+	int in_fd;
+	int out_fd;
+	void (*diverged)(unsigned int prefix, int depth, void *ctx);
+	void *ctx;
+} divergence_t;
+
+/**
+ * Ask for the digests one level below `prefix` and go down each one which
+ * differs, as long as there is a branch or array node there on either side.
+ */
+static long find_divergent(divergence_t *divergence, unsigned int prefix,
+		int depth) {
+	hamt_t *hamt = divergence->hamt;
+	digest_request_t request = { .prefix = prefix, .depth = depth };
+	digest_reply_t reply;
+	long found = 0;
+
+	if (write_full(divergence->out_fd, &request, sizeof(request)) != 0 ||
+			read_full(divergence->in_fd, &reply, sizeof(reply)) != 0) {
+		return -1;
+	}
+
+	for (unsigned int frag = 0; frag < SIZE; ++frag) {
+		unsigned int child;
+
+		if (!child_prefix(prefix, frag, depth, &child) ||
+				prefix_digest(hamt, child, depth + 1) == reply.digests[frag]) {
+			continue;
+		}
+
+		hamt_node_t *node = find_prefix(hamt, child, depth + 1);
+		bool interior = (node != NULL && !is_leaf(node)) ||
+			(reply.interior & get_mask(frag));
+
+		if (interior && depth + 1 < MAX_DEPTH) {
+			long more = find_divergent(divergence, child, depth + 1);
+
+			if (more < 0) {
+				return -1;
+			}
+			found += more;
+		} else {
+			divergence->diverged(child, depth + 1, divergence->ctx);
+			found++;
+		}
+	}
+
+	return found;
+}
+
+/**
+ * Compare against a copy of the hamt in another process running
+ * `hamt_serve_digests` on the other end of `in_fd` and `out_fd`, by going
+ * down the trie on both sides only where the digests differ. `diverged` is
+ * called with the first `depth` fragments of hash which the entries that
+ * differ start with, the smallest groups of them the tries can be split
+ * in to. Returns how many times, or -1 if the other end went away.
+ */
+long hamt_find_divergent(hamt_t *hamt, int in_fd, int out_fd,
+		void (*diverged)(unsigned int prefix, int depth, void *ctx), void *ctx) {
+	divergence_t divergence = {
+		.hamt = hamt,
+		.in_fd = in_fd,
+		.out_fd = out_fd,
+		.diverged = diverged,
+		.ctx = ctx
+	};
+	digest_request_t done = { .prefix = 0, .depth = -1 };
+
+	if (!hamt->digests) {
+		fprintf(stderr, "Finding divergence needs a hamt made with HAMT_DIGESTS\n");
+		return -1;
+	}
+
+	long found = find_divergent(&divergence, 0, 0);
+
+	if (write_full(out_fd, &done, sizeof(done)) != 0) {
+		return -1;
+	}
+
+	return found;
+}
+
+typedef struct prefix_visit_t {
+	void (*visitor)(char *key, void *value, void *ctx);
+	void *ctx;
+	unsigned int prefix;
+	int depth;
+} prefix_visit_t;
+
+static void visit_matching(hamt_node_t *leaf, void *ctx) {
+	prefix_visit_t *visit = (prefix_visit_t *)ctx;
+
+	if (matches_prefix(leaf, visit->prefix, visit->depth)) {
+		visit->visitor(leaf->key, leaf->value, visit->ctx);
+	}
+}
+
+/**
+ * Call `visitor` with every entry whose hash starts with the first `depth`
+ * fragments of `prefix`, as given to the `diverged` callback.
+ */
+void hamt_visit_prefix(hamt_t *hamt, unsigned int prefix, int depth,
+		void (*visitor)(char *key, void *value, void *ctx), void *ctx) {
+	prefix_visit_t visit = {
+		.visitor = visitor,
+		.ctx = ctx,
+		.prefix = prefix,
+		.depth = depth
+	};
+
+	visit_leaf_nodes(find_prefix(hamt, prefix, depth), visit_matching, &visit);
+}
+
+/*=========== Compaction ====== */
+#define ALIGN_UP(n) (((n) + 7) & ~(size_t)7)
+
+static size_t measure(hamt_node_t *node) {
+	if (node == NULL) {
+		return 0;
+	}
+
+	int len = child_count(node);
+	size_t size = ALIGN_UP(node_size(node));
+
+	// a path node's child is part of the node
+	if (node->type != PATH_NODE) {
+		size += ALIGN_UP(sizeof(hamt_node_t *) * len);
+	}
+
+	for (int i = 0; i < len; ++i) {
+		size += measure(node->children[i]);
+	}
+
+	return size;
+}
+
+/* NULL once the trie has grown more than was expected */
+static void *region_alloc(hamt_t *hamt, size_t size) {
+	region_t *region = &hamt->compactor.to;
+	void *ptr = NULL;
+
+	if (region->size - region->used >= ALIGN_UP(size)) {
+		ptr = region->base + region->used;
+		region->used += ALIGN_UP(size);
+	}
+
+	return ptr;
+}
+
+/**
+ * Copy a node, followed by its children, in to the new
+ * region. The children still point at the old nodes.
+ */
+static hamt_node_t *copy_node(hamt_t *hamt, hamt_node_t *node) {
+	size_t size = node_size(node);
+	int len = child_count(node);
+	hamt_node_t *copy = (hamt_node_t *)region_alloc(hamt, size);
+
+	if (copy == NULL) {
+		copy = alloc_node(hamt, size - sizeof(hamt_node_t));
+	}
+
+	memcpy(copy, node, size);
+	if (node->type == LEAF && key_is_inline(node)) {
+		copy->key = (char *)(copy + 1);
+	}
+	if (node->fingerprints != NULL) {
+		copy->fingerprints = (unsigned short *)(copy + 1);
+	}
+	if (node->type == LEAF && hamt->bounded) {
+		clock_entry(hamt, copy)->leaf = copy;
+	}
+
+	if (node->type == PATH_NODE) {
+		copy->children = (hamt_node_t **)(copy + 1);
+	} else if (len) {
+		copy->children = (hamt_node_t **)region_alloc(hamt,
+				sizeof(hamt_node_t *) * len);
+		if (copy->children == NULL) {
+			// outside the region it has to have room to grow
+			int capacity = new_capacity(hamt, node->type, len);
+
+			copy->children = alloc_children(hamt, capacity);
+			if (node->type == BRANCH) {
+				copy->bitmap = capacity;
+			}
+		}
+		memcpy(copy->children, node->children, sizeof(hamt_node_t *) * len);
+	}
+
+	return copy;
+}
+
+/* Depth first, so a subtree ends up in one piece */
+static hamt_node_t *copy_subtree(hamt_t *hamt, hamt_node_t *node) {
+	if (node == NULL) {
+		return NULL;
+	}
+
+	hamt_node_t *copy = copy_node(hamt, node);
+	int len = child_count(copy);
+
+	for (int i = 0; i < len; ++i) {
+		copy->children[i] = copy_subtree(hamt, copy->children[i]);
+	}
+
+	return copy;
+}
+
+static void free_tree(hamt_t *hamt, hamt_node_t *node) {
+	if (node == NULL) {
+		return;
+	}
+
+	int len = child_count(node);
+	for (int i = 0; i < len; ++i) {
+		free_tree(hamt, node->children[i]);
+	}
+
+	free_node(hamt, node);
+}
+
+static bool start_compaction(hamt_t *hamt, size_t slack) {
+	compactor_t *compactor = &hamt->compactor;
+	size_t size = measure(hamt->root);
+
+	if (size == 0) {
+		return false;
+	}
+
+	size += size / 100 * slack;
+	size = (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+
+	if ((compactor->to.base = (char *)aligned_alloc(CACHE_LINE_SIZE, size)) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for compaction\n");
+		return false;
+	}
+
+	hamt->bytes += size;
+	compactor->to.size = size;
+	compactor->to.used = 0;
+	compactor->next_frag = 0;
+	compactor->active = true;
+	return true;
+}
+
+/* Nothing points in to the old region any more */
+static void finish_compaction(hamt_t *hamt) {
+	compactor_t *compactor = &hamt->compactor;
+
+	hamt->bytes -= hamt->region.size;
+	free(hamt->region.base);
+	hamt->region = compactor->to;
+	memset(&compactor->to, 0, sizeof(region_t));
+	compactor->active = false;
+	cache_clear(hamt);
+}
+
+static unsigned long elapsed_us(struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000UL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * A leaf that ends up as the root part way through `hamt_compact_step` is
+ * copied out of the old region straight away. Otherwise the next insert
+ * could push it in to a subtree of the root that has already been copied,
+ * and it would be freed with the region.
+ */
+static void compact_leaf_root(hamt_t *hamt) {
+	hamt_node_t *root = hamt->root;
+
+	if (!hamt->compactor.active || !is_leaf(root) ||
+			!region_contains(&hamt->region, root)) {
+		return;
+	}
+
+	if (hamt->cache != NULL) {
+		cache_invalidate(hamt, root->hash);
+	}
+
+	hamt->root = copy_subtree(hamt, root);
+	free_tree(hamt, root);
+}
+
+/**
+ * Compact a piece at a time, each call copies whole subtrees of the root
+ * until `budget_us` microseconds have gone by, 0 meaning no limit. The root
+ * is copied last. Returns 1 while there is more to do, the trie can be
+ * changed freely between calls.
+ *
+ * Subtrees are laid out depth first one after the other, the breadth first
+ * top levels are only done by `hamt_compact`.
+ */
+int hamt_compact_step(hamt_t *hamt, unsigned long budget_us) {
+	compactor_t *compactor = &hamt->compactor;
+	struct timespec start;
+
+	// leave some space for the trie to grow before the root gets copied
+	if (!compactor->active && !start_compaction(hamt, 25)) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// a leaf at the root is copied in one go below
+	while (compactor->next_frag < SIZE && hamt->root != NULL &&
+			!is_leaf(hamt->root)) {
+		hamt_node_t **slot = child_slot(hamt->root, compactor->next_frag++);
+
+		if (slot != NULL && *slot != NULL) {
+			hamt_node_t *old = *slot;
+			*slot = copy_subtree(hamt, old);
+			free_tree(hamt, old);
+		}
+
+		if (budget_us && elapsed_us(&start) >= budget_us) {
+			cache_clear(hamt);
+			return 1;
+		}
+	}
+
+	hamt_node_t *root = hamt->root;
+	if (root != NULL && (root->type == BRANCH || root->type == ARRAY_NODE)) {
+		hamt->root = copy_node(hamt, root);
+		free_node(hamt, root);
+	} else {
+		hamt->root = copy_subtree(hamt, root);
+		free_tree(hamt, root);
+	}
+
+	finish_compaction(hamt);
+	return 0;
+}
+
+/**
+ * Copy the whole trie in to one block of memory, the top
+ * `COMPACT_BFS_LEVELS` breadth first and everything below them depth first,
+ * then free the old nodes. Finishes off a compaction started with
+ * `hamt_compact_step` instead, if there is one.
+ */
+void hamt_compact(hamt_t *hamt) {
+	if (hamt->compactor.active) {
+		hamt_compact_step(hamt, 0);
+		return;
+	}
+
+	if (!start_compaction(hamt, 0)) {
+		return;
+	}
+
+	hamt_node_t *old_root = hamt->root;
+	hamt_node_t ***slots = (hamt_node_t ***)malloc(sizeof(hamt_node_t **));
+	int count = 1;
+
+	slots[0] = &hamt->root;
+
+	for (int depth = 0; depth < COMPACT_BFS_LEVELS; ++depth) {
+		hamt_node_t ***next = (hamt_node_t ***)malloc(sizeof(hamt_node_t **) *
+				count * SIZE);
+		int next_count = 0;
+
+		for (int i = 0; i < count; ++i) {
+			hamt_node_t *copy = copy_node(hamt, *slots[i]);
+			int len = child_count(copy);
+
+			*slots[i] = copy;
+			for (int j = 0; j < len; ++j) {
+				if (copy->children[j] != NULL) {
+					next[next_count++] = &copy->children[j];
+				}
+			}
+		}
+
+		free(slots);
+		slots = next;
+		count = next_count;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		*slots[i] = copy_subtree(hamt, *slots[i]);
+	}
+
+	free(slots);
+	free_tree(hamt, old_root);
+	finish_compaction(hamt);
+}
+
+/*=========== Auto tuning ====== */
+/* How many interior nodes there are with each number of children */
+static void count_fanout(hamt_node_t *node, unsigned long *fanout) {
+	if (node == NULL || is_leaf(node)) {
+		return;
+	}
+
+	int len = child_count(node);
+	if (node->type != PATH_NODE) {
+		fanout[node->type == BRANCH ? len : node->bitmap]++;
+	}
+
+	for (int i = 0; i < len; ++i) {
+		count_fanout(node->children[i], fanout);
+	}
+}
+
+/**
+ * Estimate what `count_fanout` would count from `TUNE_SAMPLES` random walks
+ * down from the root. A node on a walk stands in for as many nodes as there
+ * were children to pick from on the way to it.
+ */
+static void sample_fanout(hamt_t *hamt, unsigned long *fanout) {
+	double estimate[SIZE + 1] = {0};
+
+	for (int i = 0; i < TUNE_SAMPLES; ++i) {
+		hamt_node_t *node = hamt->root;
+		double weight = 1;
+
+		while (node != NULL && !is_leaf(node)) {
+			if (node->type == PATH_NODE) {
+				node = node->children[0];
+				continue;
+			}
+
+			int len = child_count(node);
+			int children = node->type == BRANCH ? len : node->bitmap;
+			int pick = rand_r(&hamt->tuner.seed) % (children ? children : 1);
+			hamt_node_t *next = NULL;
+
+			estimate[children] += weight;
+			weight *= children;
+
+			// array nodes have gaps
+			for (int j = 0; j < len && next == NULL; ++j) {
+				if (node->children[j] != NULL && pick-- == 0) {
+					next = node->children[j];
+				}
+			}
+			node = next;
+		}
+	}
+
+	for (int count = 0; count <= SIZE; ++count) {
+		fanout[count] = (unsigned long)(estimate[count] / TUNE_SAMPLES + 0.5);
+	}
+}
+
+/**
+ * Pointers the interior nodes would need if branches were given room for
+ * `max_branch` children and any node with more than that was an array node.
+ */
+static unsigned long estimate_size(unsigned long *fanout, int max_branch) {
+	unsigned long size = 0;
+
+	for (int count = 0; count <= SIZE; ++count) {
+		size += fanout[count] * (count > max_branch ? SIZE : max_branch);
+	}
+
+	return size;
+}
+
+/**
+ * Pick the `max_branch` that needs the least memory for the nodes there are
+ * now. If it is mostly lookups go as low as `TUNE_MEMORY_SLACK` percent more
+ * memory allows instead, as array nodes are found without counting bits.
+ */
+static void pick_node_sizes(hamt_t *hamt, double read_share,
+		unsigned long *fanout) {
+	int best = hamt->max_branch;
+	unsigned long smallest = estimate_size(fanout, best);
+
+	for (int max_branch = 2; max_branch <= SIZE; ++max_branch) {
+		unsigned long size = estimate_size(fanout, max_branch);
+		if (size < smallest) {
+			smallest = size;
+			best = max_branch;
+		}
+	}
+
+	if (read_share >= TUNE_READ_HEAVY) {
+		for (int max_branch = 2; max_branch < best; ++max_branch) {
+			if (estimate_size(fanout, max_branch) * 100 <=
+					smallest * (100 + TUNE_MEMORY_SLACK)) {
+				best = max_branch;
+				break;
+			}
+		}
+	}
+
+	hamt->max_branch = best;
+	hamt->min_array = best / 2;
+}
+
+/**
+ * Turn every branch under `node` with more than `min_array` children in to
+ * an array node, they would be allowed to stay one and save a step on every
+ * lookup through them.
+ */
+static hamt_node_t *reshape(hamt_t *hamt, hamt_node_t *node) {
+	if (node == NULL || is_leaf(node)) {
+		return node;
+	}
+
+	if (node->type == BRANCH && popcount(node->hash) > hamt->min_array) {
+		node = branch_to_array_node(hamt, node);
+	}
+
+	int len = child_count(node);
+	for (int i = 0; i < len; ++i) {
+		node->children[i] = reshape(hamt, node->children[i]);
+	}
+
+	return node;
+}
+
+/**
+ * Pick node sizes for the mix of lookups and writes seen so far. With `walk`
+ * every node is counted and the subtrees of the root which get a lot more
+ * than their share of lookups are reshaped. Without it the sizes come from
+ * `sample_fanout` and only the root is widened, so the work doesn't grow
+ * with the size of the trie. Older statistics count for half as much each
+ * time.
+ */
+static void tune(hamt_t *hamt, bool walk) {
+	tuner_t *tuner = &hamt->tuner;
+	unsigned long lookups[SIZE];
+	unsigned long reads = 0;
+
+	for (unsigned int frag = 0; frag < SIZE; ++frag) {
+		lookups[frag] = __atomic_load_n(&tuner->lookups[frag], __ATOMIC_RELAXED);
+		__atomic_store_n(&tuner->lookups[frag], lookups[frag] / 2,
+				__ATOMIC_RELAXED);
+		reads += lookups[frag];
+	}
+
+	unsigned long writes = tuner->writes;
+	tuner->writes /= 2;
+	tuner->pending = 0;
+
+	if (hamt->root == NULL || is_leaf(hamt->root) || reads + writes == 0) {
+		return;
+	}
+
+	unsigned long fanout[SIZE + 1] = {0};
+	if (walk) {
+		count_fanout(hamt->root, fanout);
+	} else {
+		sample_fanout(hamt, fanout);
+	}
+	pick_node_sizes(hamt, (double)reads / (reads + writes), fanout);
+
+	if (reads < TUNE_MIN_LOOKUPS) {
+		return;
+	}
+
+	for (unsigned int frag = 0; frag < SIZE; ++frag) {
+		if (lookups[frag] * SIZE < reads * TUNE_HOT_FACTOR) {
+			continue;
+		}
+
+		// everything goes through the root, it is worth widening too
+		if (hamt->root->type == BRANCH &&
+				popcount(hamt->root->hash) > hamt->min_array) {
+			hamt->root = branch_to_array_node(hamt, hamt->root);
+		}
+
+		hamt_node_t **slot = child_slot(hamt->root, frag);
+		if (walk && slot != NULL) {
+			*slot = reshape(hamt, *slot);
+		}
+	}
+}
+
+/**
+ * Tune straight away, walking the whole trie. It counts as a write so must
+ * not overlap with lookups.
+ */
+void hamt_tune(hamt_t *hamt) {
+	tune(hamt, true);
+}
+
+static void count_writes(hamt_t *hamt, size_t n) {
+	tuner_t *tuner = &hamt->tuner;
+
+	if (!tuner->enabled) {
+		return;
+	}
+
+	tuner->writes += n;
+	tuner->pending += n;
+	// a write can't wait for a walk of the whole trie
+	if (tuner->pending >= TUNE_INTERVAL) {
+		tune(hamt, false);
+	}
+}
+
+static void destroy_value(hamt_node_t *leaf, void *ctx) {
+	((hamt_t *)ctx)->clock.destroy(leaf->value);
+}
+
+/**
+ * Free the hamt and everything in it. Values, and keys unless the hamt owns
+ * them, belong to the caller, apart from in cache mode where the values are
+ * destroyed.
+ */
+void hamt_free(hamt_t *hamt) {
+	if (hamt->bounded && hamt->clock.destroy != NULL) {
+		visit_leaf_nodes(hamt->root, destroy_value, hamt);
+	}
+
+	free_tree(hamt, hamt->root);
+	free(hamt->region.base);
+	free(hamt->compactor.to.base);
+	free_key_chunks(hamt, hamt->arena.head);
+	free(hamt->cache);
+	free(hamt->clock.entries);
+	free_pool(hamt->pool);
+	free(hamt);
+}
@@ -29,13 +29,87 @@
 #ifndef HAMT_H
 #define HAMT_H
 
+#define HAMT_OWN_KEYS     (1 << 0)
+#define HAMT_FINGERPRINTS (1 << 1)
+#define HAMT_DIGESTS      (1 << 2)
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HAMT_BATCH_SET    0
+#define HAMT_BATCH_REMOVE 1
+
 struct hamt_t;
 
+typedef struct hamt_batch_op_t {
+	int op; // HAMT_BATCH_SET or HAMT_BATCH_REMOVE
+	char *key;
+	void *value;
+} hamt_batch_op_t;
+
+/**
+ * Node sizes for `create_hamt_with_options`, 0 keeps the default. A branch
+ * holds up to `max_branch_size` children, at most 32, before it becomes an
+ * array node, which goes back to a branch once it is down to
+ * `min_array_node_size`, half of `max_branch_size` by default.
+ */
+typedef struct hamt_options_t {
+	int flags;
+	int max_branch_size;         // 16
+	int min_array_node_size;     // 8
+	int min_collision_node_size; // 8, the room a collision node starts with
+	int auto_tune;
+	/* With `HAMT_DIGESTS`, what a value counts as, its address if NULL */
+	uint64_t (*digest_value)(void *value);
+} hamt_options_t;
+
+typedef struct hamt_cache_stats_t {
+	unsigned long hits;
+	unsigned long misses;
+	double hit_rate;
+} hamt_cache_stats_t;
+
 struct hamt_t *create_hamt();
+struct hamt_t *create_hamt_flags(int flags);
+struct hamt_t *create_hamt_owned();
+struct hamt_t *create_hamt_cache(int flags, size_t max_bytes,
+		void (*destroy)(void *value));
+struct hamt_t *create_hamt_with_options(const hamt_options_t *options);
+void hamt_get_options(struct hamt_t *hamt, hamt_options_t *options);
+void hamt_tune(struct hamt_t *hamt);
+void hamt_free(struct hamt_t *hamt);
 struct hamt_t *hamt_set(struct hamt_t *hamt, char *key, void *value);
+struct hamt_t *hamt_set_ttl(struct hamt_t *hamt, char *key, void *value,
+		size_t value_size, unsigned long ttl_ms);
+void *hamt_upsert(struct hamt_t *hamt, char *key,
+		void *(*fn)(void *value, int found, void *ctx), void *ctx);
+void *hamt_get_or_insert(struct hamt_t *hamt, char *key, void *value);
 struct hamt_t *hamt_remove(struct hamt_t *node, char *key);
+struct hamt_t *hamt_remove_take(struct hamt_t *hamt, char *key, void **value);
+struct hamt_t *hamt_apply_batch(struct hamt_t *hamt, hamt_batch_op_t *ops,
+		size_t n);
 void *hamt_get(struct hamt_t *hamt, char *key);
+size_t hamt_expire(struct hamt_t *hamt, size_t max);
+unsigned int hamt_hash(char *key);
+size_t hamt_count(struct hamt_t *hamt);
+size_t hamt_bytes(struct hamt_t *hamt);
+int hamt_enable_front_cache(struct hamt_t *hamt, unsigned int entries);
+void hamt_front_cache_stats(struct hamt_t *hamt, hamt_cache_stats_t *stats);
+void hamt_compact(struct hamt_t *hamt);
+int hamt_compact_step(struct hamt_t *hamt, unsigned long budget_us);
 void print_hamt(struct hamt_t *hamt);
 void visit_all(struct hamt_t *hamt, void (*visitor)(char *key, void *value));
+uint64_t hamt_digest(struct hamt_t *hamt);
+int hamt_equal(struct hamt_t *a, struct hamt_t *b);
+int hamt_serve_digests(struct hamt_t *hamt, int in_fd, int out_fd);
+long hamt_find_divergent(struct hamt_t *hamt, int in_fd, int out_fd,
+		void (*diverged)(unsigned int prefix, int depth, void *ctx), void *ctx);
+void hamt_visit_prefix(struct hamt_t *hamt, unsigned int prefix, int depth,
+		void (*visitor)(char *key, void *value, void *ctx), void *ctx);
+void *hamt_parallel_fold(struct hamt_t *hamt,
+		void *(*map)(char *key, void *value, void *acc),
+		void *(*combine)(void *left, void *right), int nthreads);
+void hamt_parallel_for_each(struct hamt_t *hamt,
+		void (*fn)(char *key, void *value, void *ctx), void *ctx, int nthreads);
 
 #endif
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hamt.h"
+#include "open_table.h"
+
+#define TOMBSTONE ((char *)1)
+
+typedef struct slot_t {
+	unsigned int hash;
+	char *key;
+	void *value;
+} slot_t;
+
+struct open_table_t {
+	slot_t *slots;
+	unsigned long mask;
+	unsigned long count;
+	unsigned long used; // live entries and tombstones
+};
+
+open_table_t *open_table_create(unsigned long capacity) {
+	open_table_t *table;
+	unsigned long size = 16;
+
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	if ((table = (open_table_t *)malloc(sizeof(open_table_t))) == NULL ||
+			(table->slots = (slot_t *)calloc(size, sizeof(slot_t))) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for open table\n");
+		free(table);
+		return NULL;
+	}
+
+	table->mask = size - 1;
+	table->count = 0;
+	table->used = 0;
+	return table;
+}
+
+void open_table_free(open_table_t *table) {
+	free(table->slots);
+	free(table);
+}
+
+/* Keys are not copied, same as a hamt without `HAMT_OWN_KEYS` */
+static slot_t *find_slot(open_table_t *table, char *key, unsigned int hash) {
+	unsigned long idx = hash & table->mask;
+	slot_t *tombstone = NULL;
+
+	for (;;) {
+		slot_t *slot = &table->slots[idx];
+
+		if (slot->key == NULL) {
+			return tombstone != NULL ? tombstone : slot;
+		}
+
+		if (slot->key == TOMBSTONE) {
+			if (tombstone == NULL) {
+				tombstone = slot;
+			}
+		} else if (slot->hash == hash && strcmp(slot->key, key) == 0) {
+			return slot;
+		}
+
+		idx = (idx + 1) & table->mask;
+	}
+}
+
+/* Double in size, or just rehash when it is mostly tombstones */
+static void resize(open_table_t *table) {
+	slot_t *old = table->slots;
+	unsigned long old_size = table->mask + 1;
+	unsigned long size = table->count * 2 >= old_size ? old_size * 2 : old_size;
+
+	if ((table->slots = (slot_t *)calloc(size, sizeof(slot_t))) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for open table\n");
+		table->slots = old;
+		return;
+	}
+
+	table->mask = size - 1;
+	table->used = table->count;
+
+	for (unsigned long i = 0; i < old_size; ++i) {
+		if (old[i].key != NULL && old[i].key != TOMBSTONE) {
+			unsigned long idx = old[i].hash & table->mask;
+
+			while (table->slots[idx].key != NULL) {
+				idx = (idx + 1) & table->mask;
+			}
+			table->slots[idx] = old[i];
+		}
+	}
+
+	free(old);
+}
+
+void open_table_set(open_table_t *table, char *key, void *value) {
+	unsigned int hash = hamt_hash(key);
+	slot_t *slot = find_slot(table, key, hash);
+
+	if (slot->key == NULL || slot->key == TOMBSTONE) {
+		if (slot->key == NULL) {
+			table->used++;
+		}
+		table->count++;
+		slot->hash = hash;
+	}
+
+	slot->key = key;
+	slot->value = value;
+
+	// keep the load, tombstones included, under 3/4
+	if (table->used * 4 > (table->mask + 1) * 3) {
+		resize(table);
+	}
+}
+
+void *open_table_get(open_table_t *table, char *key) {
+	unsigned int hash = hamt_hash(key);
+	unsigned long idx = hash & table->mask;
+
+	for (;;) {
+		slot_t *slot = &table->slots[idx];
+
+		if (slot->key == NULL) {
+			return NULL;
+		}
+
+		if (slot->key != TOMBSTONE && slot->hash == hash &&
+				strcmp(slot->key, key) == 0) {
+			return slot->value;
+		}
+
+		idx = (idx + 1) & table->mask;
+	}
+}
+
+void open_table_remove(open_table_t *table, char *key) {
+	unsigned int hash = hamt_hash(key);
+	slot_t *slot = find_slot(table, key, hash);
+
+	if (slot->key != NULL && slot->key != TOMBSTONE) {
+		slot->key = TOMBSTONE;
+		slot->value = NULL;
+		table->count--;
+	}
+}
+
+unsigned long open_table_count(open_table_t *table) {
+	return table->count;
+}
@@ -0,0 +1,17 @@
+#ifndef OPEN_TABLE_H
+#define OPEN_TABLE_H
+
+/**
+ * A flat open addressing hash table with linear probing, only here as
+ * something to measure the hamt against.
+ */
+typedef struct open_table_t open_table_t;
+
+open_table_t *open_table_create(unsigned long capacity);
+void open_table_free(open_table_t *table);
+void open_table_set(open_table_t *table, char *key, void *value);
+void *open_table_get(open_table_t *table, char *key);
+void open_table_remove(open_table_t *table, char *key);
+unsigned long open_table_count(open_table_t *table);
+
+#endif
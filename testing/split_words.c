@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "split_words.h"
+
+char **split_words(char *contents, int *count) {
+	// the last word need not end in a newline
+	int len = 1;
+	char **words;
+
+	for (char *ptr = contents; *ptr != '\0'; ++ptr) {
+		if (*ptr == '\n') {
+			len++;
+		}
+	}
+
+	if ((words = (char **)malloc(sizeof(char *) * len)) == NULL) {
+		fprintf(stderr, "Failed to allocate memory for words\n");
+		exit(EXIT_FAILURE);
+	}
+
+	*count = 0;
+	for (char *ptr = contents; *ptr != '\0'; ++ptr) {
+		if (ptr == contents || *(ptr - 1) == '\0') {
+			words[(*count)++] = ptr;
+		}
+		if (*ptr == '\n') {
+			*ptr = '\0';
+		}
+	}
+
+	return words;
+}
@@ -0,0 +1,10 @@
+#ifndef SPLIT_WORDS_H
+#define SPLIT_WORDS_H
+
+/**
+ * Split the dictionary in to an array of words, the words point in to
+ * `contents`
+ */
+char **split_words(char *contents, int *count);
+
+#endif